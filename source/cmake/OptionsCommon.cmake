@@ -182,4 +182,6 @@ endif ()
 
 
 find_package(PurC 0.9.17 REQUIRED)
+find_package(Threads REQUIRED)
+find_package(ZLIB REQUIRED)
 
@@ -2,3 +2,7 @@ list(APPEND hvmlfpm_SOURCES
     "libfcgi/os_unix.c"
 )
 
+# the rest of libfcgi for the test program
+list(APPEND testfcgiparams_SOURCES
+    "libfcgi/os_unix.c"
+)
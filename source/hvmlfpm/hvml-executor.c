@@ -27,778 +27,3360 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <string.h>
 #include <getopt.h>
 #include <limits.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <syslog.h>
+#include <zlib.h>
 
 #include "config.h"
 #include "hvml-executor.h"
 #include "mpart-body-processor.h"
+#include "xml-body-processor.h"
+#include "page-cache.h"
+#include "util/kvlist.h"
+#include "libfcgi/fcgiapp.h"
+#include "libfcgi/fastcgi.h"
+#ifdef NO_FCGI_DEFINES
 #include "libfcgi/fcgi_stdio.h"
 
+/* given by the test program along with FCGI_Accept() */
+const char *FCGI_LookupParam(const FCGX_ParamKey *key, int *valueLen);
+int FCGI_GetParamCount(void);
+int FCGI_GetParamAt(int i, FCGX_Param *param);
+#endif
+
 #define RUNNER_INFO_NAME    "runner-data"
 
+enum content_coding {
+    CC_IDENTITY = 0,
+    CC_GZIP,
+    CC_DEFLATE,
+};
+
+static const char *content_codings[] = {
+    NULL,
+    "gzip",
+    "deflate",
+};
+
+/* how long a page stays fresh, and then is served while being made again */
+struct page_ttl {
+    unsigned ttl;
+    unsigned grace;
+};
+
+/*
+ * The context of a request: the streams its content is read from and its
+ * response is written to, and the request which has the parameters.
+ * The test program, built with NO_FCGI_DEFINES, gives the parameters
+ * by FCGI_Accept() and friends, and the streams are stdin and stdout.
+ */
+struct request_context {
+#ifdef NO_FCGI_DEFINES
+    FILE *in;
+    FILE *out;
+#else
+    FCGX_Request fcgx;
+    FCGX_Stream *in;
+    FCGX_Stream *out;
+#endif
+};
+
 struct runner_info {
     bool verbose;
     purc_coroutine_t main_crtn;
     purc_rwstream_t dump_stm;
-};
 
-#define MY_VRT_OPTS \
-    (PCVRNT_SERIALIZE_OPT_SPACED | PCVRNT_SERIALIZE_OPT_NOSLASHESCAPE)
+    /* _RESPONSE of the request being executed */
+    purc_variant_t response;
 
-static int prog_cond_handler(purc_cond_k event, purc_coroutine_t cor,
-        void *data)
-{
-    if (event == PURC_COND_COR_EXITED) {
-        struct runner_info *runner_info = NULL;
-        purc_get_local_data(RUNNER_INFO_NAME,
-                (uintptr_t *)(void *)&runner_info, NULL);
-        assert(runner_info);
+    /* make ETags and answer 304 for matched conditional requests */
+    bool auto_etag;
 
-        size_t sz;
-        if (runner_info->verbose) {
-            if (cor == runner_info->main_crtn) {
-                HFLOG_INFO("The main coroutine exited.\n");
-            }
-            else {
-                HFLOG_INFO("A child coroutine exited.\n");
-                goto done;
-            }
+    /* If-None-Match of the request; NULL if it does not apply */
+    const char *if_none_match;
 
-            struct purc_cor_exit_info *exit_info = data;
-            if (purc_document_type(exit_info->doc) == PCDOC_K_TYPE_HTML) {
-                fprintf(stdout, "Content-Type: text/html\r\n\r\n");
+    /* the key in the page cache; NULL if the page is not cacheable */
+    char *cache_key;
 
-                unsigned opt = PCDOC_SERIALIZE_OPT_FULL_DOCTYPE;
-                opt |= PCDOC_SERIALIZE_OPT_UNDEF;
-                opt |= PCDOC_SERIALIZE_OPT_FULL_DOCTYPE;
-                opt |= PCDOC_SERIALIZE_OPT_IGNORE_C0CTRLS;
+    /* the lease on the page taken for the request */
+    uint64_t cache_lease;
 
-                pcdoc_serialize_fragment_to_stream(exit_info->doc, NULL,
-                        opt, runner_info->dump_stm);
-            }
-            else if (purc_variant_array_size(exit_info->result, &sz) &&
-                    sz > 0) {
-                /* TODO: we may need a new document type */
-                for (size_t i = 0; i < sz; i++) {
-                    purc_variant_t item;
-                    item = purc_variant_array_get(exit_info->result, i);
-
-                    const unsigned char *content;
-                    size_t nr_bytes;
-                    content  = purc_variant_get_bytes_const(item, &nr_bytes);
-
-                    if (content && nr_bytes > 0) {
-                        if (purc_variant_get_string_const(item)) {
-                            nr_bytes--;
-                        }
-                        HFLOG_INFO("Writing content (%zd)\n", nr_bytes);
-                        fwrite((void *)content, nr_bytes, 1, stdout);
-                    }
-                    else {
-                        HFLOG_WARN("Item is not a string or binary sequence.\n");
-                    }
-                }
-            }
-            else {
-                fprintf(stdout, "Content-Type: application/json\r\n\r\n");
-                purc_variant_serialize(exit_info->result,
-                        runner_info->dump_stm, 0, MY_VRT_OPTS, NULL);
-            }
-        }
-    }
-    else if (event == PURC_COND_COR_TERMINATED) {
-        struct runner_info *runner_info = NULL;
-        purc_get_local_data(RUNNER_INFO_NAME,
-                (uintptr_t *)(void *)&runner_info, NULL);
-        assert(runner_info);
+    /* the TTL configured for the script */
+    struct page_ttl cache_ttl;
 
-        struct purc_cor_term_info *term_info = data;
-        if (cor == runner_info->main_crtn) {
-            HFLOG_INFO("The main coroutine terminated due to "
-                    "an uncaught exception: %s.\n",
-                    purc_atom_to_string(term_info->except));
-        }
-        else {
-            HFLOG_INFO("child coroutine terminated due to "
-                    "an uncaught exception: %s.\n",
-                    purc_atom_to_string(term_info->except));
-        }
+    /* making the page again after the expired one was sent */
+    bool revalidating;
 
-        if (purc_document_type(term_info->doc) == PCDOC_K_TYPE_HTML) {
-            fprintf(stdout, "Content-Type: text/html\r\n\r\n");
+    /* the content coding accepted by the client for the response */
+    enum content_coding coding;
 
-            unsigned opt = PCDOC_SERIALIZE_OPT_FULL_DOCTYPE;
-            opt |= PCDOC_SERIALIZE_OPT_UNDEF;
-            opt |= PCDOC_SERIALIZE_OPT_FULL_DOCTYPE;
-            opt |= PCDOC_SERIALIZE_OPT_IGNORE_C0CTRLS;
+    /* the headers and the head of the page were sent before the exit */
+    bool head_sent;
 
-            pcdoc_serialize_fragment_to_stream(term_info->doc, NULL,
-                    opt, runner_info->dump_stm);
-        }
+    /* the headers were sent, and the items of _RESPONSE.stream follow */
+    bool streaming;
 
-        if (runner_info->verbose) {
-            fprintf(stdout, ">> The executing stack frame(s):\n");
-            purc_coroutine_dump_stack(cor, runner_info->dump_stm);
-            fprintf(stdout, "\n");
-        }
-    }
+    /* the client of the stream has gone, but the coroutine goes on */
+    bool client_gone;
 
-done:
-    return 0;
-}
+    /* the request is run along with others by the worker */
+    bool multiplexed;
 
-struct request_info {
-    purc_variant_t server;
-    purc_variant_t get;
-    purc_variant_t post;
-    purc_variant_t cookie;
-    purc_variant_t files;
-    purc_variant_t request;
-    purc_vdom_t vdom;
+    /* the request being executed */
+    struct request_context *ctx;
 };
 
-enum value_type {
-    VT_STRING,
-    VT_ULONG,
-};
+#define MY_VRT_OPTS \
+    (PCVRNT_SERIALIZE_OPT_SPACED | PCVRNT_SERIALIZE_OPT_NOSLASHESCAPE)
 
-enum post_content_type {
-    CT_BAD = -1,
-    CT_NOT_SUPPORTED = 0,
-    CT_FORM_URLENCODED,
-    CT_FORM_DATA,
-    CT_JSON,
-    CT_XML,
-    CT_PLAIN,
+static const struct http_status {
+    unsigned code;
+    const char *reason;
+} http_statuses[] = {
+    { 200, "OK" },
+    { 201, "Created" },
+    { 202, "Accepted" },
+    { 204, "No Content" },
+    { 301, "Moved Permanently" },
+    { 302, "Found" },
+    { 303, "See Other" },
+    { 304, "Not Modified" },
+    { 307, "Temporary Redirect" },
+    { 308, "Permanent Redirect" },
+    { 400, "Bad Request" },
+    { 401, "Unauthorized" },
+    { 403, "Forbidden" },
+    { 404, "Not Found" },
+    { 405, "Method Not Allowed" },
+    { 409, "Conflict" },
+    { 410, "Gone" },
+    { 413, "Payload Too Large" },
+    { 415, "Unsupported Media Type" },
+    { 422, "Unprocessable Content" },
+    { 429, "Too Many Requests" },
+    { 500, "Internal Server Error" },
+    { 501, "Not Implemented" },
+    { 502, "Bad Gateway" },
+    { 503, "Service Unavailable" },
 };
 
-#define strncasecmp2ltr(str, literal, len)      \
-    ((len > (sizeof(literal "") - 1)) ? 1 :     \
-        (len < (sizeof(literal "") - 1) ? -1 : strncasecmp(str, literal, len)))
-
-static enum post_content_type
-check_post_content_type(const char *content_type, const char **boundary)
+static const char *http_status_reason(unsigned code)
 {
-    size_t whole_len = strlen(content_type);
-    size_t mime_len = 0;
+    for (size_t i = 0; i < PCA_TABLESIZE(http_statuses); i++) {
+        if (http_statuses[i].code == code)
+            return http_statuses[i].reason;
+    }
 
-    enum post_content_type ct = CT_NOT_SUPPORTED;
-    const char *mime = pcutils_get_next_token(content_type, ";", &mime_len);
-    if (mime_len == 0)
-        goto bad;
+    return NULL;
+}
 
-    *boundary = NULL;
-    if (mime_len < whole_len) {
-        const char *extkv = mime + mime_len + 1;
-        size_t key_len;
-        extkv = pcutils_get_next_token(extkv, " =", &key_len);
-        if (key_len == 0 || extkv[key_len] != '=') {
-            printf("No extra key value pair: %s\n", extkv);
-            goto bad;
-        }
+/* the token characters of RFC 9110 */
+#define HTTP_TOKEN_CHARS                        \
+    "!#$%&'*+-.^_`|~0123456789"                 \
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"                \
+    "abcdefghijklmnopqrstuvwxyz"
 
-        if (strncasecmp2ltr(extkv, "charset", key_len) == 0) {
-            const char *value = extkv + key_len + 1;
-            size_t value_len = mime_len - key_len - 1;
-            if (strncasecmp2ltr(value, "utf-8", value_len))
-                goto bad;
-        }
-        else if (strncasecmp2ltr(extkv, "boundary", key_len) == 0) {
-            const char *value = extkv + key_len + 1;
-            *boundary = value;
+static void send_header(purc_rwstream_t stm, const char *name,
+        purc_variant_t value)
+{
+    char buf[64];
+    const char *str;
+    size_t len;
+
+    if (purc_variant_is_string(value)) {
+        str = purc_variant_get_string_const_ex(value, &len);
+    }
+    else {
+        ssize_t n = purc_variant_stringify_buff(buf, sizeof(buf), value);
+        if (n < 0 || (size_t)n >= sizeof(buf)) {
+            HFLOG_WARN("Ignored bad value of header %s\n", name);
+            return;
         }
+        str = buf;
+        len = n;
     }
 
-    size_t type_len;
-    const char *type = pcutils_get_next_token_len(mime, mime_len, "/", &type_len);
-    if (type_len == 0 || type_len == mime_len)
-        goto bad;
+    /* no way to inject other headers or the body */
+    if (str == NULL || memchr(str, '\r', len) || memchr(str, '\n', len)) {
+        HFLOG_WARN("Ignored bad value of header %s\n", name);
+        return;
+    }
 
-    const char *subtype = type + type_len + 1;
-    size_t subtype_len = mime_len - type_len - 1;
+    purc_rwstream_write(stm, name, strlen(name));
+    purc_rwstream_write(stm, ": ", 2);
+    purc_rwstream_write(stm, str, len);
+    purc_rwstream_write(stm, "\r\n", 2);
+}
 
-    if (strncasecmp2ltr(type, "application", type_len) == 0) {
-        if (strncasecmp2ltr(subtype, "x-www-form-urlencoded", subtype_len) == 0) {
-            ct = CT_FORM_URLENCODED;
-        }
-        else if (strncasecmp2ltr(subtype, "json", subtype_len) == 0) {
-            ct = CT_JSON;
-        }
-        else {
-            ct = CT_NOT_SUPPORTED;
-        }
+static uint32_t response_status(purc_variant_t response)
+{
+    uint32_t status = 200;
+
+    purc_variant_t v = purc_variant_object_get_by_ckey(response,
+            HVML_RESP_STATUS);
+    if (v && (!purc_variant_cast_to_uint32(v, &status, false) ||
+                status < 100 || status > 999)) {
+        HFLOG_WARN("Ignored bad response status\n");
+        status = 200;
     }
-    else if (strncasecmp2ltr(type, "multipart", type_len) == 0 &&
-            strncasecmp2ltr(subtype, "form-data", subtype_len) == 0) {
-        ct = CT_FORM_DATA;
+
+    return status;
+}
+
+/*
+ * Sends the status and the headers set by the script in _RESPONSE to stm.
+ * The value of a header can be an array to send the header several
+ * times, e.g. for `Set-Cookie`.  If the script did not set one,
+ * `Content-Type` is default_type.  When default_type is NULL, the
+ * header section is left open for the content to complete it.
+ */
+static void send_headers(purc_rwstream_t stm, purc_variant_t response,
+        const char *default_type)
+{
+    uint32_t status = 200;
+    purc_variant_t headers = PURC_VARIANT_INVALID;
+    bool has_type = false;
+
+    if (response) {
+        status = response_status(response);
+        headers = purc_variant_object_get_by_ckey(response,
+                HVML_RESP_HEADERS);
     }
-    else if (strncasecmp2ltr(type, "text", type_len) == 0) {
-        if (strncasecmp2ltr(subtype, "xml", subtype_len) == 0) {
-            ct = CT_XML;
-        }
-        else if (strncasecmp2ltr(subtype, "plain", subtype_len) == 0) {
-            ct = CT_PLAIN;
-        }
+
+    if (status != 200) {
+        char buf[64];
+        const char *reason = http_status_reason(status);
+        int n = snprintf(buf, sizeof(buf), "Status: %u %s\r\n", status,
+                reason ? reason : "");
+        purc_rwstream_write(stm, buf, n);
     }
 
-    return ct;
+    if (headers && purc_variant_is_object(headers)) {
+        struct pcvrnt_object_iterator *it;
+        it = pcvrnt_object_iterator_create_begin(headers);
+        while (it) {
+            const char *name = pcvrnt_object_iterator_get_ckey(it);
+            purc_variant_t value = pcvrnt_object_iterator_get_value(it);
 
-bad:
-    return CT_BAD;
+            if (name[0] == 0 || name[strspn(name, HTTP_TOKEN_CHARS)]) {
+                HFLOG_WARN("Ignored header with bad name: %s\n", name);
+            }
+            else if (strcasecmp(name, "Status") == 0) {
+                HFLOG_WARN("Use " HVML_VAR_RESPONSE "." HVML_RESP_STATUS
+                        " instead of Status header\n");
+            }
+            else {
+                if (strcasecmp(name, HTTP_CONTENT_TYPE) == 0)
+                    has_type = true;
+
+                size_t sz;
+                if (purc_variant_array_size(value, &sz)) {
+                    for (size_t i = 0; i < sz; i++)
+                        send_header(stm, name,
+                                purc_variant_array_get(value, i));
+                }
+                else {
+                    send_header(stm, name, value);
+                }
+            }
+
+            if (!pcvrnt_object_iterator_next(it))
+                break;
+        }
+
+        if (it)
+            pcvrnt_object_iterator_release(it);
+    }
+
+    if (default_type) {
+        /* a 304 response has no content to describe */
+        if (!has_type && status != 304) {
+            purc_rwstream_write(stm, HTTP_CONTENT_TYPE ": ",
+                    sizeof(HTTP_CONTENT_TYPE ": ") - 1);
+            purc_rwstream_write(stm, default_type, strlen(default_type));
+            purc_rwstream_write(stm, "\r\n", 2);
+        }
+        purc_rwstream_write(stm, "\r\n", 2);
+    }
 }
 
-static purc_variant_t parse_content_as_form_urlencoded(size_t content_length)
+/*
+ * Finds a header set by the script.  The names of the headers are
+ * case-insensitive, e.g. `etag` is `ETag`; the name used by the script
+ * is returned via *key if key is not NULL.
+ */
+static purc_variant_t find_header(purc_variant_t headers, const char *name,
+        const char **key)
 {
     purc_variant_t v = PURC_VARIANT_INVALID;
 
-    char *buf = malloc(content_length + 1);
-    if (buf) {
-        size_t n = fread(buf, 1, content_length, stdin);
-        if (n == content_length) {
-            buf[content_length] = 0;
-
-            v = purc_make_object_from_query_string(buf, true);
-            if (v == PURC_VARIANT_INVALID) {
-                HFLOG_ERROR("Failed when parsing content.\n");
-            }
-        }
-        else {
-            HFLOG_ERROR("Mismatched content length and content got.\n");
+    if (headers == PURC_VARIANT_INVALID || !purc_variant_is_object(headers))
+        return v;
+
+    struct pcvrnt_object_iterator *it;
+    it = pcvrnt_object_iterator_create_begin(headers);
+    while (it) {
+        const char *ckey = pcvrnt_object_iterator_get_ckey(it);
+        if (strcasecmp(ckey, name) == 0) {
+            v = pcvrnt_object_iterator_get_value(it);
+            if (key)
+                *key = ckey;
+            break;
         }
 
-        free(buf);
-    }
-    else {
-        HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+        if (!pcvrnt_object_iterator_next(it))
+            break;
     }
 
+    if (it)
+        pcvrnt_object_iterator_release(it);
     return v;
 }
 
-static ssize_t cb_stdio_write(void *ctxt, const void *buf, size_t count)
+/* Sets a header, replacing the one set by the script in any case. */
+static bool set_header(purc_variant_t headers, const char *name,
+        purc_variant_t v)
 {
-    FILE *fp = ctxt;
-    return fwrite((void *)buf, 1, count, fp);
-}
+    const char *key;
 
-static ssize_t cb_stdio_read(void *ctxt, void *buf, size_t count)
-{
-    FILE *fp = ctxt;
-    return fread(buf, 1, count, fp);
+    if (find_header(headers, name, &key))
+        return purc_variant_object_set_by_ckey(headers, key, v);
+    return purc_variant_object_set_by_static_ckey(headers, name, v);
 }
 
-static purc_variant_t parse_content_as_json(size_t content_length)
+enum result_kind {
+    RK_HTML,
+    RK_RAW,
+    RK_JSON,
+};
+
+/* NULL for RK_RAW: the content completes the header section itself */
+static const char *result_types[] = {
+    "text/html",
+    NULL,
+    "application/json",
+};
+
+static enum result_kind
+check_result_kind(struct purc_cor_exit_info *exit_info)
 {
-    (void)content_length;
-    purc_variant_t v = PURC_VARIANT_INVALID;
-    purc_rwstream_t stm;
-    stm = purc_rwstream_new_for_read(stdin, cb_stdio_read);
+    size_t sz;
 
-    if (stm) {
-        v = purc_variant_load_from_json_stream(stm);
-        purc_rwstream_destroy(stm);
-    }
-    else {
-        HFLOG_ERROR("Failed when making stream from stdio\n");
-    }
+    if (purc_document_type(exit_info->doc) == PCDOC_K_TYPE_HTML)
+        return RK_HTML;
 
-    return v;
-}
+    /* TODO: we may need a new document type */
+    if (purc_variant_array_size(exit_info->result, &sz) && sz > 0)
+        return RK_RAW;
 
-/* TODO:
-static purc_variant_t parse_content_as_xml(size_t content_length)
-{
-} */
+    return RK_JSON;
+}
 
-static purc_variant_t parse_content_as_plain(size_t content_length)
+static void serialize_document(purc_document_t doc, purc_rwstream_t stm)
 {
-    purc_variant_t v = PURC_VARIANT_INVALID;
+    unsigned opt = PCDOC_SERIALIZE_OPT_FULL_DOCTYPE;
+    opt |= PCDOC_SERIALIZE_OPT_UNDEF;
+    opt |= PCDOC_SERIALIZE_OPT_FULL_DOCTYPE;
+    opt |= PCDOC_SERIALIZE_OPT_IGNORE_C0CTRLS;
 
-    char *buf = malloc(content_length + 1);
-    if (buf) {
-        size_t n = fread(buf, 1, content_length, stdin);
-        if (n == content_length) {
-            buf[content_length] = 0;
+    pcdoc_serialize_fragment_to_stream(doc, NULL, opt, stm);
+}
 
-            v = purc_variant_make_string_reuse_buff(buf, content_length + 1,
-                    true);
-            if (v == PURC_VARIANT_INVALID) {
-                HFLOG_ERROR("Failed when make string from content.\n");
-                goto failed;
+static void serialize_result(struct purc_cor_exit_info *exit_info,
+        enum result_kind kind, purc_rwstream_t stm)
+{
+    if (kind == RK_HTML) {
+        serialize_document(exit_info->doc, stm);
+    }
+    else if (kind == RK_RAW) {
+        size_t sz = 0;
+        purc_variant_array_size(exit_info->result, &sz);
+        for (size_t i = 0; i < sz; i++) {
+            purc_variant_t item;
+            item = purc_variant_array_get(exit_info->result, i);
+
+            const unsigned char *content;
+            size_t nr_bytes;
+            content  = purc_variant_get_bytes_const(item, &nr_bytes);
+
+            if (content && nr_bytes > 0) {
+                if (purc_variant_get_string_const(item)) {
+                    nr_bytes--;
+                }
+                HFLOG_INFO("Writing content (%zd)\n", nr_bytes);
+                purc_rwstream_write(stm, content, nr_bytes);
+            }
+            else {
+                HFLOG_WARN("Item is not a string or binary sequence.\n");
             }
-        }
-        else {
-            HFLOG_ERROR("Mismatched content length and content got.\n");
-            goto failed;
         }
     }
     else {
-        HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+        purc_variant_serialize(exit_info->result, stm, 0, MY_VRT_OPTS, NULL);
     }
-
-    return v;
-
-failed:
-    free(buf);
-    return v;
 }
 
-static int release_request(struct request_info *info)
+/* 64-bit FNV-1a; fast enough to hash every response body */
+static uint64_t hash_body(const char *body, size_t len)
 {
+    uint64_t hash = 0xcbf29ce484222325ULL;
 
-    if (info->server) {
-        purc_variant_unref(info->server);
-    }
-
-    if (info->get) {
-        purc_variant_unref(info->get);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)body[i];
+        hash *= 0x100000001b3ULL;
     }
 
-    if (info->post) {
-        purc_variant_unref(info->post);
-    }
+    return hash;
+}
 
-    if (info->cookie) {
-        purc_variant_unref(info->cookie);
-    }
+/*
+ * Checks whether the entity tag matches one in the value of If-None-Match,
+ * with the weak comparison required by RFC 9110.
+ */
+static bool etag_matches(const char *list, const char *etag)
+{
+    if (strncmp(etag, "W/", 2) == 0)
+        etag += 2;
+    size_t etag_len = strlen(etag);
+
+    const char *p = list;
+    while (*(p += strspn(p, " \t,"))) {
+        if (*p == '*')
+            return true;
+
+        if (strncmp(p, "W/", 2) == 0)
+            p += 2;
+
+        const char *tag = p;
+        if (*p == '"') {
+            const char *end = strchr(p + 1, '"');
+            if (end == NULL)
+                break;
+            p = end + 1;
+        }
+        else {
+            p += strcspn(p, " \t,");
+        }
 
-    if (info->files) {
-        purc_variant_unref(info->files);
+        if ((size_t)(p - tag) == etag_len && strncmp(tag, etag, etag_len) == 0)
+            return true;
     }
 
-    if (info->request) {
-        purc_variant_unref(info->request);
-    }
+    return false;
+}
 
-    memset(info, 0, sizeof(*info));
-    return 0;
+/*
+ * Returns the ETag set by the script.  If there is none and generate is
+ * true, makes a strong one from the body and sets it.
+ */
+static const char *get_etag(purc_variant_t headers, const char *body,
+        size_t len, bool generate)
+{
+    purc_variant_t v = find_header(headers, "ETag", NULL);
+    if (v)
+        return purc_variant_get_string_const(v);
+
+    if (!generate)
+        return NULL;
+
+    char buf[64];
+    snprintf(buf, sizeof(buf), "\"%016" PRIx64 "-%zx\"",
+            hash_body(body, len), len);
+    v = purc_variant_make_string(buf, false);
+    if (v == PURC_VARIANT_INVALID)
+        return NULL;
+
+    /* the headers keep the string alive */
+    const char *etag = purc_variant_get_string_const(v);
+    purc_variant_object_set_by_static_ckey(headers, "ETag", v);
+    purc_variant_unref(v);
+    return etag;
 }
 
-static int make_request(struct request_info *info)
+/*
+ * Returns how long the page can stay in the page cache: `Cache-Control`
+ * set by the script (`s-maxage`, then `max-age`) wins over ttl, the one
+ * configured for the script.  Pages setting cookies are never cached.
+ * Likewise, `stale-while-revalidate` wins over the grace period.
+ */
+static unsigned get_page_ttl(purc_variant_t headers, unsigned ttl,
+        unsigned *grace)
 {
-    info->server = purc_variant_make_object_0();
+    if (find_header(headers, "Set-Cookie", NULL))
+        return 0;
+
+    purc_variant_t v = find_header(headers, "Cache-Control", NULL);
+    const char *p = v ? purc_variant_get_string_const(v) : NULL;
+    if (p == NULL)
+        return ttl;
+
+    long max_age = -1, s_maxage = -1, swr = -1;
+    while (*(p += strspn(p, " \t,"))) {
+        if (strncasecmp(p, "no-store", 8) == 0 ||
+                strncasecmp(p, "no-cache", 8) == 0 ||
+                strncasecmp(p, "private", 7) == 0)
+            return 0;
+        else if (strncasecmp(p, "s-maxage=", 9) == 0)
+            s_maxage = strtol(p + 9, NULL, 10);
+        else if (strncasecmp(p, "max-age=", 8) == 0)
+            max_age = strtol(p + 8, NULL, 10);
+        else if (strncasecmp(p, "stale-while-revalidate=", 23) == 0)
+            swr = strtol(p + 23, NULL, 10);
+
+        p += strcspn(p, ",");
+    }
 
-    static struct var_type {
-        const char *name;
-        enum value_type type;
-    } meta_vars[] = {
+    if (swr >= 0)
+        *grace = (swr > UINT_MAX) ? UINT_MAX : (unsigned)swr;
 
-        // This variable identifies any mechanism used by the server to
-        // authenticate the user.
-        { "AUTH_TYPE", VT_STRING },
+    if (s_maxage < 0)
+        s_maxage = max_age;
+    if (s_maxage < 0)
+        return ttl;
+    return (s_maxage > UINT_MAX) ? UINT_MAX : (unsigned)s_maxage;
+}
 
-        // This variable contains the size of the message-body attached to
-        // the request, if any, in decimal number of octets.
-        { "CONTENT_LENGTH", VT_ULONG },
-
-        // If the request includes a message-body, this variable is
-        // set to the Internet Media Type [6] of the message-body.
-        { "CONTENT_TYPE", VT_STRING },
-
-        // This variable MUST be set to the dialect of CGI being used by
-        // the server to communicate with the script.
-        { "GATEWAY_INTERFACE", VT_STRING },
-
-        // This variable specifies a path to be interpreted by the CGI script.
-        { "PATH_INFO", VT_STRING },
-
-        // This variable is derived by taking the PATH_INFO value,
-        // parsing it as a local URI in its own right, and performing any
-        // virtual-to-physical translation appropriate to map it onto the
-        // server's document repository structure.
-        { "PATH_TRANSLATED", VT_STRING },
-
-        // This variable contains a URL-encoded search or parameter
-        // string; it provides information to the CGI script to affect or refine
-        // the document to be returned by the script.
-        { "QUERY_STRING", VT_STRING },
-
-        // This variable MUST be set to the network address of the
-        // client sending the request to the server.
-        { "REMOTE_ADDR", VT_STRING },
-
-        // This variable contains the fully qualified domain name of
-        // the client sending the request to the server, if available, otherwise
-        // NULL.
-        { "REMOTE_HOST", VT_STRING },
-
-        // This variable MAY be used to provide identity information
-        // reported about the connection by an RFC 1413 [20] request to the
-        // remote agent, if available.
-        { "REMOTE_IDENT", VT_STRING },
-
-        // This variable provides a user identification string
-        // supplied by client as part of user authentication.
-        { "REMOTE_USER", VT_STRING },
-
-        // This variable MUST be set to the method which
-        // should be used by the script to process the request.
-        { "REQUEST_METHOD", VT_STRING },
-
-        // This variable MUST be set to a URI path (not URL-encoded)
-        // which could identify the CGI script (rather than the script's
-        // output).
-        { "SCRIPT_NAME", VT_STRING },
-
-        // This variable MUST be set to the name of the server host
-        // to which the client request is directed.  It is a case-insensitive
-        // hostname or network address.
-        { "SERVER_NAME", VT_STRING },
+/* The responses are not compressed unless a level is given. */
+static int compress_level = -1;
+static size_t compress_min_size = 1024;
 
-        // This variable MUST be set to the TCP/IP port number on
-        // which this request is received from the client.
-        { "SERVER_PORT", VT_ULONG },
+/*
+ * Parses the compression settings given in the form of `6,1K`: the level
+ * of zlib (1 to 9), then the minimal size of the body worth compressing,
+ * with the suffixes K and M as in the limits of request bodies.
+ */
+static int set_compression(const char *spec)
+{
+    char *end;
+    long level = strtol(spec, &end, 10);
+    if (end == spec || level < Z_BEST_SPEED || level > Z_BEST_COMPRESSION)
+        goto bad;
 
-        // This variable MUST be set to the name and version of
-        // the application protocol used for this CGI request.
-        { "SERVER_PROTOCOL", VT_STRING },
+    if (*end == ',') {
+        const char *size = end + 1;
+        unsigned long long min_size = strtoull(size, &end, 10);
+        if (end == size)
+            goto bad;
 
-        // This variable MUST be set to the name and version
-        // of the information server software making the CGI request (and
-        // running the gateway).
-        { "SERVER_SOFTWARE", VT_STRING },
+        switch (*end) {
+        case 'M': case 'm':
+            min_size *= 1024;
+            /* fall through */
+        case 'K': case 'k':
+            min_size *= 1024;
+            end++;
+            break;
+        }
 
-        // The visitor's cookie, if one is set.
-        { "HTTP_COOKIE", VT_STRING },
+        if (min_size > SIZE_MAX)
+            goto bad;
+        compress_min_size = (size_t)min_size;
+    }
 
-        // The hostname of the page being attempted
-        { "HTTP_HOST", VT_STRING },
+    if (*end)
+        goto bad;
 
-        // The URL of the page that called your program
-        { "HTTP_REFERER", VT_STRING },
+    compress_level = (int)level;
+    return 0;
 
-        // The browser type of the visitor
-        { "HTTP_USER_AGENT", VT_STRING },
+bad:
+    syslog(LOG_ERR, "Bad compression settings: %s\n", spec);
+    return -1;
+}
 
-        /* The following variables were not defined in RFC 3875. */
+/*
+ * Chooses the content coding from Accept-Encoding by the q-values;
+ * gzip wins a tie.  The codings not listed take the q-value of `*`.
+ */
+static enum content_coding get_content_coding(const char *accept)
+{
+    if (compress_level < 0 || accept == NULL)
+        return CC_IDENTITY;
+
+    double q_gzip = -1, q_deflate = -1, q_any = 0;
+    const char *p = accept;
+    while (*(p += strspn(p, " \t,"))) {
+        size_t len = strcspn(p, " \t;,");
+        const char *params = p + len;
+        size_t params_len = strcspn(params, ",");
+
+        double q = 1;
+        const char *qp = memchr(params, 'q', params_len);
+        if (qp && qp[1] == '=')
+            q = strtod(qp + 2, NULL);
+
+        if ((len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+                (len == 6 && strncasecmp(p, "x-gzip", 6) == 0))
+            q_gzip = q;
+        else if (len == 7 && strncasecmp(p, "deflate", 7) == 0)
+            q_deflate = q;
+        else if (len == 1 && *p == '*')
+            q_any = q;
+
+        p = params + params_len;
+    }
 
-        // The root directory of the server
-        { "DOCUMENT_ROOT", VT_STRING },
+    if (q_gzip < 0)
+        q_gzip = q_any;
+    if (q_deflate < 0)
+        q_deflate = q_any;
 
-        // The port the client is connected to on the server
-        { "REMOTE_PORT", VT_ULONG },
+    if (q_gzip > 0 && q_gzip >= q_deflate)
+        return CC_GZIP;
+    if (q_deflate > 0)
+        return CC_DEFLATE;
+    return CC_IDENTITY;
+}
 
-        // "on" if the program is being called through a secure server
-        { "HTTPS", VT_STRING },
+/*
+ * Compresses the body in one go, since the whole of it is at hand;
+ * returns NULL if the compressed body is no smaller.  The caller frees
+ * the compressed body.
+ */
+static char *compress_body(enum content_coding coding,
+        const char *body, size_t len, size_t *zlen)
+{
+    z_stream zs = { };
 
-        // The interpreted pathname of the requested document or CGI
-        // (relative to the document root)
-        { "REQUEST_URI", VT_STRING },
+    /* gzip has its own wrapper; deflate is the zlib format (RFC 9110) */
+    int bits = (coding == CC_GZIP) ? MAX_WBITS + 16 : MAX_WBITS;
+    if (deflateInit2(&zs, compress_level, Z_DEFLATED, bits, 8,
+                Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
 
-        // The full pathname of the current CGI
-        { "SCRIPT_FILENAME", VT_STRING },
+    size_t bound = deflateBound(&zs, len);
+    char *buf = malloc(bound);
+    if (buf == NULL)
+        goto failed;
 
-        // The email address for your server's webmaster
-        { "SERVER_ADMIN", VT_STRING },
+    zs.next_in = (Bytef *)body;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)buf;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= len)
+        goto failed;
 
-        // The Authorization
-        { "HTTP_AUTHORIZATION", VT_STRING },
-    };
+    *zlen = zs.total_out;
+    deflateEnd(&zs);
+    return buf;
 
-    for (size_t i = 0; i < PCA_TABLESIZE(meta_vars); i++) {
-        purc_variant_t tmp = PURC_VARIANT_INVALID;
+failed:
+    free(buf);
+    deflateEnd(&zs);
+    return NULL;
+}
 
-        const char *value = getenv(meta_vars[i].name);
-        if (value) {
-            if (meta_vars[i].type == VT_ULONG) {
-                unsigned long ul = strtoul(value, NULL, 10);
-                tmp = purc_variant_make_ulongint(ul);
-            }
-            else {
-                tmp = purc_variant_make_string_static(value, true);
-            }
+/* Checks whether the comma-separated list has the token. */
+static bool list_has_token(const char *list, const char *token)
+{
+    size_t token_len = strlen(token);
+    const char *p = list;
+    while (*(p += strspn(p, " \t,"))) {
+        size_t len = strcspn(p, " \t,");
+        if (len == token_len && strncasecmp(p, token, len) == 0)
+            return true;
+        p += len;
+    }
 
-            if (tmp == PURC_VARIANT_INVALID) {
-                HFLOG_ERROR("Failed when making an variant for %s\n",
-                        meta_vars[i].name);
-                goto failed;
+    return false;
+}
+
+/*
+ * Adds a header, or appends the value to the one set by the script,
+ * e.g. `Vary: Cookie, Accept-Encoding`.
+ */
+static void add_header(purc_variant_t headers, const char *name,
+        const char *value)
+{
+    purc_variant_t v = find_header(headers, name, NULL);
+    const char *old = v ? purc_variant_get_string_const(v) : NULL;
+
+    if (old && *old) {
+        if (list_has_token(old, value))
+            return;
+
+        size_t len = strlen(old) + strlen(value) + 3;
+        char *buf = malloc(len);
+        if (buf == NULL)
+            return;
+        snprintf(buf, len, "%s, %s", old, value);
+        v = purc_variant_make_string_reuse_buff(buf, len, false);
+    }
+    else {
+        v = purc_variant_make_string_static(value, false);
+    }
+
+    if (v) {
+        set_header(headers, name, v);
+        purc_variant_unref(v);
+    }
+}
+
+/*
+ * Compresses the body in the coding accepted by the client.  An ETag set
+ * by the script is tagged with the coding, since the compressed body is
+ * another representation; generated ones are made from the compressed
+ * body already.
+ */
+static char *encode_body(struct runner_info *runner_info,
+        purc_variant_t headers, const char *body, size_t *len)
+{
+    if (compress_level < 0 || *len < compress_min_size ||
+            find_header(headers, "Content-Encoding", NULL))
+        return NULL;
+
+    /* the response differs by Accept-Encoding, whatever the client took */
+    add_header(headers, "Vary", "Accept-Encoding");
+
+    if (runner_info->coding == CC_IDENTITY)
+        return NULL;
+
+    char *zbody = compress_body(runner_info->coding, body, *len, len);
+    if (zbody == NULL)
+        return NULL;
+
+    const char *coding = content_codings[runner_info->coding];
+    add_header(headers, "Content-Encoding", coding);
+
+    purc_variant_t v = find_header(headers, "ETag", NULL);
+    const char *etag = v ? purc_variant_get_string_const(v) : NULL;
+    size_t etag_len = etag ? strlen(etag) : 0;
+    if (etag_len >= 2 && etag[etag_len - 1] == '"') {
+        size_t n = etag_len + strlen(coding) + 2;
+        char *buf = malloc(n);
+        if (buf) {
+            snprintf(buf, n, "%.*s-%s\"", (int)etag_len - 1, etag, coding);
+            v = purc_variant_make_string_reuse_buff(buf, n, false);
+            if (v) {
+                set_header(headers, "ETag", v);
+                purc_variant_unref(v);
             }
         }
-        else if (meta_vars[i].type == VT_ULONG) {
-            tmp = purc_variant_make_ulongint(0);
-            if (tmp == PURC_VARIANT_INVALID) {
-                HFLOG_ERROR("Failed when making a ulong 0 variant for %s\n",
-                        meta_vars[i].name);
-                goto failed;
-            }
+    }
+
+    return zbody;
+}
+
+#define MIN_BODY_BUFFER     (16 * 1024)
+#define MAX_BODY_BUFFER     (64 * 1024 * 1024)
+
+#define MIN_HEADER_BUFFER   1024
+#define MAX_HEADER_BUFFER   (64 * 1024)
+
+/*
+ * Sends the result via buffers: the whole body is needed to make a strong
+ * ETag, and the whole response to store the page in the page cache.
+ * When the client already has the body, answers 304 without it.
+ */
+static void send_buffered_result(struct runner_info *runner_info,
+        struct purc_cor_exit_info *exit_info, enum result_kind kind)
+{
+    purc_variant_t response = runner_info->response;
+    char *zbody = NULL;
+
+    purc_rwstream_t body_stm = purc_rwstream_new_buffer(MIN_BODY_BUFFER,
+            MAX_BODY_BUFFER);
+    purc_rwstream_t hdr_stm = purc_rwstream_new_buffer(MIN_HEADER_BUFFER,
+            MAX_HEADER_BUFFER);
+    if (body_stm == NULL || hdr_stm == NULL) {
+        HFLOG_ERROR("Failed to make buffer streams for the response.\n");
+        send_headers(runner_info->dump_stm, response, result_types[kind]);
+        serialize_result(exit_info, kind, runner_info->dump_stm);
+        goto done;
+    }
+
+    serialize_result(exit_info, kind, body_stm);
+
+    size_t body_len = 0;
+    char *body = purc_rwstream_get_mem_buffer(body_stm, &body_len);
+
+    const char *etag = NULL;
+    unsigned ttl = 0;
+    unsigned grace = runner_info->cache_ttl.grace;
+    purc_variant_t headers = purc_variant_object_get_by_ckey(response,
+            HVML_RESP_HEADERS);
+    if (headers && purc_variant_is_object(headers)) {
+        zbody = encode_body(runner_info, headers, body, &body_len);
+        if (zbody)
+            body = zbody;
+
+        etag = get_etag(headers, body, body_len, runner_info->auto_etag);
+        if (runner_info->cache_key)
+            ttl = get_page_ttl(headers, runner_info->cache_ttl.ttl, &grace);
+    }
+
+    uint32_t status = response_status(response);
+    send_headers(hdr_stm, response, result_types[kind]);
+
+    size_t hdr_len = 0;
+    char *hdrs = purc_rwstream_get_mem_buffer(hdr_stm, &hdr_len);
+
+    if (status == 200 && ttl > 0) {
+        page_cache_store(runner_info->cache_key, ttl, grace, etag,
+                hdrs, hdr_len, body, body_len);
+    }
+
+    /* the client got the expired page already */
+    if (runner_info->revalidating)
+        goto done;
+
+    if (status == 200 && etag && runner_info->if_none_match &&
+            etag_matches(runner_info->if_none_match, etag)) {
+        purc_variant_t v = purc_variant_make_ulongint(304);
+        if (v) {
+            purc_variant_object_set_by_static_ckey(response,
+                    HVML_RESP_STATUS, v);
+            purc_variant_unref(v);
+            send_headers(runner_info->dump_stm, response, result_types[kind]);
+            goto done;
         }
+    }
 
-        if (tmp) {
-            bool success = purc_variant_object_set_by_static_ckey(info->server,
-                    meta_vars[i].name, tmp);
-            purc_variant_unref(tmp);
-            if (!success) {
-                HFLOG_ERROR("Failed when making a property for %s\n",
-                        meta_vars[i].name);
-                goto failed;
-            }
+    purc_rwstream_write(runner_info->dump_stm, hdrs, hdr_len);
+    purc_rwstream_write(runner_info->dump_stm, body, body_len);
+
+done:
+    free(zbody);
+    if (body_stm)
+        purc_rwstream_destroy(body_stm);
+    if (hdr_stm)
+        purc_rwstream_destroy(hdr_stm);
+}
+
+/* the interval to check again for the page another worker is making */
+#define COALESCE_POLL_INTERVAL  10      /* ms */
+
+/* the time to wait for the page before making it too */
+#define MAX_COALESCE_WAIT       2000    /* ms */
+
+/*
+ * Sends the page in the page cache.  On PAGE_CACHE_MISS, there is none
+ * and the caller is to make the page; on PAGE_CACHE_STALE, the expired
+ * page was sent and the caller is to make the page again.  The requests
+ * for the page being made by another worker wait for it instead of
+ * running the script again, for max_wait milliseconds at most.
+ */
+static enum page_cache_result
+send_cached_page(purc_rwstream_t stm, const char *key, uint64_t lease,
+        const char *if_none_match, unsigned max_wait)
+{
+    struct page_cache_hit hit;
+    enum page_cache_result result;
+    unsigned waited = 0;
+
+    while ((result = page_cache_lookup(key, lease, &hit)) == PAGE_CACHE_BUSY &&
+            waited < max_wait) {
+        usleep(COALESCE_POLL_INTERVAL * 1000);
+        waited += COALESCE_POLL_INTERVAL;
+    }
+
+    if (result == PAGE_CACHE_BUSY)
+        return PAGE_CACHE_MISS;
+    if (result == PAGE_CACHE_MISS)
+        return result;
+
+    if (hit.etag && if_none_match && etag_matches(if_none_match, hit.etag)) {
+        static const char status[] = "Status: 304 Not Modified\r\nETag: ";
+        purc_rwstream_write(stm, status, sizeof(status) - 1);
+        purc_rwstream_write(stm, hit.etag, strlen(hit.etag));
+        purc_rwstream_write(stm, "\r\n\r\n", 4);
+    }
+    else {
+        purc_rwstream_write(stm, hit.data, hit.hdr_len + hit.body_len);
+    }
+
+    return result;
+}
+
+/*
+ * Gives up the lease on the page if it was not stored, so that the other
+ * workers need not wait for it any longer.
+ */
+static void release_cache_key(struct runner_info *runner_info)
+{
+    if (runner_info->cache_key) {
+        page_cache_release(runner_info->cache_key, runner_info->cache_lease);
+        free(runner_info->cache_key);
+        runner_info->cache_key = NULL;
+    }
+}
+
+static void init_request_context(struct request_context *ctx)
+{
+#ifdef NO_FCGI_DEFINES
+    ctx->in = stdin;
+    ctx->out = stdout;
+#else
+    FCGX_InitRequest(&ctx->fcgx, FCGI_LISTENSOCK_FILENO, 0);
+    ctx->in = NULL;
+    ctx->out = NULL;
+#endif
+}
+
+/*
+ * Finishes the last request of the context and accepts the next one;
+ * returns a negative value on failure, e.g. -EAGAIN if the listening
+ * socket is non-blocking and no connection is waiting.
+ */
+static int accept_request(struct request_context *ctx)
+{
+#ifdef NO_FCGI_DEFINES
+    (void)ctx;
+    return FCGI_Accept();
+#else
+    int rc = FCGX_Accept_r(&ctx->fcgx);
+    if (rc >= 0) {
+        ctx->in = ctx->fcgx.in;
+        ctx->out = ctx->fcgx.out;
+    }
+    else {
+        ctx->in = NULL;
+        ctx->out = NULL;
+    }
+
+    return rc;
+#endif
+}
+
+static void finish_request(struct request_context *ctx)
+{
+#ifdef NO_FCGI_DEFINES
+    fflush(ctx->out);
+#else
+    FCGX_Finish_r(&ctx->fcgx);
+    ctx->in = NULL;
+    ctx->out = NULL;
+#endif
+}
+
+/*
+ * Writes to the output stream of the request directly; the FastCGI stream
+ * copies small pieces into its buffer, and writes large ones from where
+ * they are.
+ */
+static ssize_t cb_output_write(void *ctxt, const void *buf, size_t count)
+{
+    struct request_context *ctx = ctxt;
+
+#ifdef NO_FCGI_DEFINES
+    return fwrite(buf, 1, count, ctx->out);
+#else
+    if (ctx->out == NULL)
+        return -1;
+
+    if (count > INT_MAX)
+        count = INT_MAX;
+    return FCGX_PutStr(buf, (int)count, ctx->out);
+#endif
+}
+
+/* Flushes the output of the request; returns 0 on success. */
+static int flush_output(struct runner_info *runner_info)
+{
+#ifdef NO_FCGI_DEFINES
+    return fflush(runner_info->ctx->out);
+#else
+    return FCGX_FFlush(runner_info->ctx->out);
+#endif
+}
+
+/*
+ * Ends the response, so that the client gets it at once; the parameters
+ * of the request stay valid until the request is finished.
+ */
+static void end_response(struct runner_info *runner_info)
+{
+#ifdef NO_FCGI_DEFINES
+    fflush(runner_info->ctx->out);
+#else
+    FCGX_EndResponse_r(&runner_info->ctx->fcgx);
+#endif
+}
+
+/* The responses are sent only when the coroutine exits unless enabled. */
+static bool progressive_output;
+
+/* Checks whether the whole response is needed before sending it. */
+static bool is_buffered(struct runner_info *runner_info)
+{
+    return runner_info->auto_etag || runner_info->cache_key ||
+        compress_level >= 0;
+}
+
+/*
+ * Sends the serialized HTML document up to the end of the head, or the
+ * rest of it.  Returns false if there is no head in the document.
+ */
+static bool send_document_part(purc_rwstream_t stm, purc_document_t doc,
+        bool head)
+{
+    purc_rwstream_t buf_stm = purc_rwstream_new_buffer(MIN_BODY_BUFFER,
+            MAX_BODY_BUFFER);
+    if (buf_stm == NULL) {
+        HFLOG_ERROR("Failed to make a buffer stream for the document.\n");
+        return false;
+    }
+
+    serialize_document(doc, buf_stm);
+
+    size_t len = 0;
+    const char *html = purc_rwstream_get_mem_buffer(buf_stm, &len);
+    static const char end_tag[] = "</head>";
+    size_t head_len = 0;
+    for (size_t i = 0; i + sizeof(end_tag) - 1 <= len; i++) {
+        if (html[i] == '<' &&
+                strncasecmp(html + i, end_tag, sizeof(end_tag) - 1) == 0) {
+            head_len = i + sizeof(end_tag) - 1;
+            break;
         }
     }
 
-#if 0
-    tmp = purc_variant_make_longint(fileno(stdout));
-    if (tmp == PURC_VARIANT_INVALID) {
-        HFLOG_ERROR("Failed when making a ulong 0 variant for %s\n", "FCGIFD");
-        goto failed;
+    if (head)
+        purc_rwstream_write(stm, html, head_len);
+    else
+        purc_rwstream_write(stm, html + head_len, len - head_len);
+
+    purc_rwstream_destroy(buf_stm);
+    return head_len > 0;
+}
+
+/*
+ * Sends the headers and the head of the page when the main coroutine
+ * finished its first run but goes on observing, e.g. waiting for the data
+ * fetched; the client can then load the styles and the scripts meanwhile.
+ * The headers and the head are final from now on.
+ */
+static void send_head_early(struct runner_info *runner_info,
+        struct purc_cor_run_info *run_info)
+{
+    if (run_info->run_idx > 0 || runner_info->head_sent ||
+            runner_info->revalidating || is_buffered(runner_info) ||
+            purc_document_type(run_info->doc) != PCDOC_K_TYPE_HTML)
+        return;
+
+    purc_rwstream_t buf_stm = purc_rwstream_new_buffer(MIN_HEADER_BUFFER,
+            MAX_BODY_BUFFER);
+    if (buf_stm == NULL)
+        return;
+
+    if (send_document_part(buf_stm, run_info->doc, true)) {
+        size_t len = 0;
+        const char *head = purc_rwstream_get_mem_buffer(buf_stm, &len);
+
+        send_headers(runner_info->dump_stm, runner_info->response,
+                "text/html");
+        purc_rwstream_write(runner_info->dump_stm, head, len);
+        flush_output(runner_info);
+        runner_info->head_sent = true;
+    }
+
+    purc_rwstream_destroy(buf_stm);
+}
+
+#define SSE_CONTENT_TYPE    "text/event-stream"
+
+/* Writes the value as the lines of the data field of the event. */
+static void write_event_data(purc_rwstream_t stm, purc_variant_t data)
+{
+    const char *str = purc_variant_get_string_const(data);
+    if (str == NULL) {
+        /* serialized in one line */
+        purc_rwstream_write(stm, "data: ", 6);
+        purc_variant_serialize(data, stm, 0, MY_VRT_OPTS, NULL);
+        purc_rwstream_write(stm, "\n", 1);
+        return;
+    }
+
+    do {
+        size_t len = strcspn(str, "\r\n");
+        purc_rwstream_write(stm, "data: ", 6);
+        purc_rwstream_write(stm, str, len);
+        purc_rwstream_write(stm, "\n", 1);
+
+        str += len;
+        if (str[0] == '\r' && str[1] == '\n')
+            str++;
+    } while (*str++);
+}
+
+/*
+ * Writes an item of _RESPONSE.stream as an event: an object gives the
+ * fields `event`, `id`, `retry`, and `data`; anything else is the data.
+ */
+static void write_event(purc_rwstream_t stm, purc_variant_t item)
+{
+    if (!purc_variant_is_object(item)) {
+        write_event_data(stm, item);
+        purc_rwstream_write(stm, "\n", 1);
+        return;
+    }
+
+    static const char *fields[] = { "event", "id", "retry" };
+    for (size_t i = 0; i < PCA_TABLESIZE(fields); i++) {
+        purc_variant_t v = purc_variant_object_get_by_ckey(item, fields[i]);
+        if (v == PURC_VARIANT_INVALID)
+            continue;
+
+        purc_rwstream_write(stm, fields[i], strlen(fields[i]));
+        purc_rwstream_write(stm, ": ", 2);
+        const char *str = purc_variant_get_string_const(v);
+        if (str) {
+            /* a line break would end the field */
+            purc_rwstream_write(stm, str, strcspn(str, "\r\n"));
+        }
+        else {
+            purc_variant_serialize(v, stm, 0, MY_VRT_OPTS, NULL);
+        }
+        purc_rwstream_write(stm, "\n", 1);
+    }
+
+    purc_variant_t data = purc_variant_object_get_by_ckey(item, "data");
+    if (data)
+        write_event_data(stm, data);
+    purc_rwstream_write(stm, "\n", 1);
+}
+
+/* Writes an item of _RESPONSE.stream as it is, or serialized if not bytes. */
+static void write_chunk(purc_rwstream_t stm, purc_variant_t item)
+{
+    size_t nr_bytes;
+    const unsigned char *content;
+    content = purc_variant_get_bytes_const(item, &nr_bytes);
+
+    if (content) {
+        if (purc_variant_get_string_const(item) && nr_bytes > 0)
+            nr_bytes--;
+        purc_rwstream_write(stm, content, nr_bytes);
     }
     else {
-        bool success = purc_variant_object_set_by_static_ckey(info->server,
-                "FCGIFD", tmp);
-        purc_variant_unref(tmp);
-        if (!success) {
-            HFLOG_ERROR("Failed when making a property for %s\n", "FCGIFD");
-            goto failed;
+        purc_variant_serialize(item, stm, 0, MY_VRT_OPTS, NULL);
+    }
+}
+
+/*
+ * Sends the items the script appended to _RESPONSE.stream, as events for
+ * text/event-stream or as they are for other types, then empties it.
+ * Returns false if the client has gone.
+ */
+static bool send_stream_items(struct runner_info *runner_info)
+{
+    purc_variant_t response = runner_info->response;
+    purc_variant_t stream = purc_variant_object_get_by_ckey(response,
+            HVML_RESP_STREAM);
+    size_t sz = 0;
+    if (stream == PURC_VARIANT_INVALID ||
+            !purc_variant_array_size(stream, &sz) || sz == 0)
+        return true;
+
+    bool sse = true;
+    purc_variant_t headers = purc_variant_object_get_by_ckey(response,
+            HVML_RESP_HEADERS);
+    purc_variant_t type = find_header(headers, HTTP_CONTENT_TYPE, NULL);
+    if (type) {
+        const char *str = purc_variant_get_string_const(type);
+        sse = str && strncasecmp(str, SSE_CONTENT_TYPE,
+                sizeof(SSE_CONTENT_TYPE) - 1) == 0;
+    }
+
+    for (size_t i = 0; i < sz; i++) {
+        purc_variant_t item = purc_variant_array_get(stream, i);
+        if (sse)
+            write_event(runner_info->dump_stm, item);
+        else
+            write_chunk(runner_info->dump_stm, item);
+    }
+
+    while (sz > 0)
+        purc_variant_array_remove(stream, --sz);
+
+    return flush_output(runner_info) == 0;
+}
+
+/*
+ * Starts a streaming response once the main coroutine, after a run, left
+ * items in _RESPONSE.stream; the headers are sent then, with the type
+ * text/event-stream by default.  Afterwards, the items left by every run
+ * are sent at once, and the document is not sent at all.  Returns false
+ * if the client of the stream has gone.
+ */
+static bool send_stream(struct runner_info *runner_info)
+{
+    if (runner_info->client_gone)
+        return false;
+    if (runner_info->revalidating)
+        return true;
+
+    if (!runner_info->streaming) {
+        purc_variant_t stream = purc_variant_object_get_by_ckey(
+                runner_info->response, HVML_RESP_STREAM);
+        size_t sz = 0;
+        if (runner_info->head_sent || stream == PURC_VARIANT_INVALID ||
+                !purc_variant_array_size(stream, &sz) || sz == 0)
+            return true;
+
+        /* neither the web server nor a proxy should hold the events */
+        purc_variant_t headers = purc_variant_object_get_by_ckey(
+                runner_info->response, HVML_RESP_HEADERS);
+        if (headers && purc_variant_is_object(headers)) {
+            if (!find_header(headers, "Cache-Control", NULL))
+                add_header(headers, "Cache-Control", "no-cache");
+            if (!find_header(headers, "X-Accel-Buffering", NULL))
+                add_header(headers, "X-Accel-Buffering", "no");
         }
+
+        send_headers(runner_info->dump_stm, runner_info->response,
+                SSE_CONTENT_TYPE);
+        runner_info->streaming = true;
+
+        /* a stream is never cached; the others need not wait for it */
+        release_cache_key(runner_info);
     }
-#endif
 
-    const char *method =
-        purc_variant_get_string_const(
-                purc_variant_object_get_by_ckey(info->server, "REQUEST_METHOD"));
-
-    if (strcasecmp(method, "GET") == 0) {
-        const char *query =
-            purc_variant_get_string_const(
-                    purc_variant_object_get_by_ckey(info->server, "QUERY_STRING"));
-        if (query) {
-            info->get = purc_make_object_from_query_string(query, true);
-            if (info->get == PURC_VARIANT_INVALID) {
-                HFLOG_ERROR("Failed when parsing query string\n");
-                goto failed;
-            }
+    if (!send_stream_items(runner_info)) {
+        HFLOG_WARN("The client of the stream has gone.\n");
+        release_cache_key(runner_info);
+        runner_info->client_gone = true;
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * The main coroutine of a request has the runner of the request as its
+ * user data, so that the output goes to the request which the coroutine
+ * runs for; the child coroutines have none.
+ */
+static int prog_cond_handler(purc_cond_k event, purc_coroutine_t cor,
+        void *data)
+{
+    struct runner_info *runner_info = NULL;
+    if (event == PURC_COND_COR_ONE_RUN || event == PURC_COND_COR_EXITED ||
+            event == PURC_COND_COR_TERMINATED) {
+        runner_info = purc_coroutine_get_user_data(cor);
+    }
+
+    if (event == PURC_COND_COR_ONE_RUN) {
+        if (runner_info) {
+            /* nothing stops the coroutine observing; abort the run, so
+               that serve_requests() quits and a new worker takes over.
+               The other requests of the worker go on, if any; see
+               mux_cond_handler() */
+            if (!send_stream(runner_info) && !runner_info->multiplexed)
+                purc_runloop_stop(purc_runloop_get_current());
+            else if (progressive_output && !runner_info->streaming)
+                send_head_early(runner_info, data);
         }
     }
-    else if (strcasecmp(method, "POST") == 0) {
-        uint32_t tmp;
-        purc_variant_cast_to_uint32(
-                purc_variant_object_get_by_ckey(info->server,
-                    "CONTENT_LENGTH"), &tmp, false);
-        size_t content_length = (size_t)tmp;
+    else if (event == PURC_COND_COR_EXITED) {
+        if (runner_info == NULL) {
+            HFLOG_INFO("A child coroutine exited.\n");
+            goto done;
+        }
 
-        if (content_length > 0) {
-            const char *content_type =
-                purc_variant_get_string_const(purc_variant_object_get_by_ckey(
-                            info->server, "CONTENT_TYPE"));
+        if (runner_info->verbose)
+            HFLOG_INFO("The main coroutine exited.\n");
 
-            if (content_type) {
-                enum post_content_type ct;
-                const char *boundary;
-                ct = check_post_content_type(content_type, &boundary);
+        struct purc_cor_exit_info *exit_info = data;
+        enum result_kind kind = check_result_kind(exit_info);
+        if (runner_info->streaming) {
+            send_stream(runner_info);
+        }
+        else if (runner_info->head_sent) {
+            send_document_part(runner_info->dump_stm, exit_info->doc,
+                    false);
+        }
+        else if (is_buffered(runner_info) && result_types[kind]) {
+            send_buffered_result(runner_info, exit_info, kind);
+        }
+        else if (!runner_info->revalidating) {
+            send_headers(runner_info->dump_stm, runner_info->response,
+                    result_types[kind]);
+            serialize_result(exit_info, kind, runner_info->dump_stm);
+        }
 
-                if (ct <= 0) {
-                    HFLOG_ERROR("not supported content type: %s\n", content_type);
-                    goto failed;
-                }
+        end_response(runner_info);
+    }
+    else if (event == PURC_COND_COR_TERMINATED) {
+        struct purc_cor_term_info *term_info = data;
+        if (runner_info == NULL) {
+            HFLOG_INFO("child coroutine terminated due to "
+                    "an uncaught exception: %s.\n",
+                    purc_atom_to_string(term_info->except));
+            goto done;
+        }
+
+        HFLOG_INFO("The main coroutine terminated due to "
+                "an uncaught exception: %s.\n",
+                purc_atom_to_string(term_info->except));
+
+        if (runner_info->streaming) {
+            send_stream(runner_info);
+        }
+        else if (!runner_info->revalidating &&
+                purc_document_type(term_info->doc) == PCDOC_K_TYPE_HTML) {
+            if (runner_info->head_sent) {
+                send_document_part(runner_info->dump_stm, term_info->doc,
+                        false);
+            }
+            else {
+                send_headers(runner_info->dump_stm, runner_info->response,
+                        "text/html");
+                serialize_document(term_info->doc, runner_info->dump_stm);
+            }
+        }
+
+        if (runner_info->verbose) {
+            static const char frames[] = ">> The executing stack frame(s):\n";
+            purc_rwstream_write(runner_info->dump_stm, frames,
+                    sizeof(frames) - 1);
+            purc_coroutine_dump_stack(cor, runner_info->dump_stm);
+            purc_rwstream_write(runner_info->dump_stm, "\n", 1);
+        }
+
+        end_response(runner_info);
+    }
+
+done:
+    return 0;
+}
+
+struct request_info {
+    purc_variant_t server;
+    purc_variant_t get;
+    purc_variant_t post;
+    purc_variant_t cookie;
+    purc_variant_t files;
+    purc_variant_t response;
+    purc_variant_t request;
+    purc_vdom_t vdom;
+};
+
+enum post_content_type {
+    CT_BAD = -1,
+    CT_NOT_SUPPORTED = 0,
+    CT_FORM_URLENCODED,
+    CT_FORM_DATA,
+    CT_JSON,
+    CT_XML,
+    CT_PLAIN,
+    CT_NDJSON,
+    CT_OCTET_STREAM,
+};
+
+#define strncasecmp2ltr(str, literal, len)      \
+    ((len > (sizeof(literal "") - 1)) ? 1 :     \
+        (len < (sizeof(literal "") - 1) ? -1 : strncasecmp(str, literal, len)))
+
+static enum post_content_type
+check_post_content_type(const char *content_type, const char **boundary)
+{
+    size_t whole_len = strlen(content_type);
+    size_t mime_len = 0;
+
+    enum post_content_type ct = CT_NOT_SUPPORTED;
+    const char *mime = pcutils_get_next_token(content_type, ";", &mime_len);
+    if (mime_len == 0)
+        goto bad;
+
+    *boundary = NULL;
+    if (mime_len < whole_len) {
+        const char *extkv = mime + mime_len + 1;
+        size_t key_len;
+        extkv = pcutils_get_next_token(extkv, " =", &key_len);
+        if (key_len == 0 || extkv[key_len] != '=') {
+            HFLOG_WARN("No extra key value pair: %s\n", extkv);
+            goto bad;
+        }
+
+        if (strncasecmp2ltr(extkv, "charset", key_len) == 0) {
+            const char *value = extkv + key_len + 1;
+            size_t value_len = mime_len - key_len - 1;
+            if (strncasecmp2ltr(value, "utf-8", value_len))
+                goto bad;
+        }
+        else if (strncasecmp2ltr(extkv, "boundary", key_len) == 0) {
+            const char *value = extkv + key_len + 1;
+            *boundary = value;
+        }
+    }
+
+    size_t type_len;
+    const char *type = pcutils_get_next_token_len(mime, mime_len, "/", &type_len);
+    if (type_len == 0 || type_len == mime_len)
+        goto bad;
+
+    const char *subtype = type + type_len + 1;
+    size_t subtype_len = mime_len - type_len - 1;
+
+    /* the structured syntax suffix, e.g. `+json` of `vnd.api+json` */
+    const char *suffix = memchr(subtype, '+', subtype_len);
+    size_t suffix_len = suffix ? subtype + subtype_len - suffix : 0;
+
+    if (strncasecmp2ltr(type, "application", type_len) == 0) {
+        if (strncasecmp2ltr(subtype, "x-www-form-urlencoded", subtype_len) == 0) {
+            ct = CT_FORM_URLENCODED;
+        }
+        else if (strncasecmp2ltr(subtype, "json", subtype_len) == 0 ||
+                (suffix && strncasecmp2ltr(suffix, "+json", suffix_len) == 0)) {
+            ct = CT_JSON;
+        }
+        else if (strncasecmp2ltr(subtype, "xml", subtype_len) == 0 ||
+                (suffix && strncasecmp2ltr(suffix, "+xml", suffix_len) == 0)) {
+            ct = CT_XML;
+        }
+        else if (strncasecmp2ltr(subtype, "x-ndjson", subtype_len) == 0 ||
+                strncasecmp2ltr(subtype, "jsonl", subtype_len) == 0) {
+            ct = CT_NDJSON;
+        }
+        else if (strncasecmp2ltr(subtype, "octet-stream", subtype_len) == 0) {
+            ct = CT_OCTET_STREAM;
+        }
+        else {
+            ct = CT_NOT_SUPPORTED;
+        }
+    }
+    else if (strncasecmp2ltr(type, "multipart", type_len) == 0 &&
+            strncasecmp2ltr(subtype, "form-data", subtype_len) == 0) {
+        ct = CT_FORM_DATA;
+    }
+    else if (strncasecmp2ltr(type, "text", type_len) == 0) {
+        if (strncasecmp2ltr(subtype, "xml", subtype_len) == 0) {
+            ct = CT_XML;
+        }
+        else if (strncasecmp2ltr(subtype, "plain", subtype_len) == 0) {
+            ct = CT_PLAIN;
+        }
+    }
+
+    return ct;
+
+bad:
+    return CT_BAD;
+}
+
+#define NR_CONTENT_TYPES    (CT_OCTET_STREAM + 1)
+
+/*
+ * The maximum sizes of the request bodies, indexed by the content type.
+ * Bodies larger than the limit are rejected with 413 before being read.
+ */
+static size_t body_limits[NR_CONTENT_TYPES] = {
+    0,                  /* CT_NOT_SUPPORTED */
+    8 * 1024 * 1024,    /* CT_FORM_URLENCODED */
+    64 * 1024 * 1024,   /* CT_FORM_DATA */
+    8 * 1024 * 1024,    /* CT_JSON */
+    8 * 1024 * 1024,    /* CT_XML */
+    8 * 1024 * 1024,    /* CT_PLAIN */
+    8 * 1024 * 1024,    /* CT_NDJSON */
+    64 * 1024 * 1024,   /* CT_OCTET_STREAM */
+};
+
+static const char *body_limit_names[NR_CONTENT_TYPES] = {
+    NULL,
+    "urlencoded",
+    "form-data",
+    "json",
+    "xml",
+    "plain",
+    "ndjson",
+    "octet-stream",
+};
+
+/*
+ * Parses the limits of request bodies given in the form of
+ * `8M,form-data=64M,json=512K`: a size without name applies to
+ * all content types; the suffixes K, M, and G multiply by 1024,
+ * 1024^2, and 1024^3 respectively.
+ */
+static int set_body_limits(const char *spec)
+{
+    const char *item = spec;
+
+    while (*item) {
+        size_t item_len = strcspn(item, ",");
+        const char *size = item;
+        int ct = 0;
+
+        const char *eq = memchr(item, '=', item_len);
+        if (eq) {
+            size_t name_len = eq - item;
+            for (ct = CT_FORM_URLENCODED; ct < NR_CONTENT_TYPES; ct++) {
+                if (strlen(body_limit_names[ct]) == name_len &&
+                        strncasecmp(item, body_limit_names[ct], name_len) == 0)
+                    break;
+            }
+
+            if (ct == NR_CONTENT_TYPES)
+                goto bad;
+            size = eq + 1;
+        }
+
+        char *end;
+        unsigned long long limit = strtoull(size, &end, 10);
+        if (end == size)
+            goto bad;
+
+        switch (*end) {
+        case 'G': case 'g':
+            limit *= 1024;
+            /* fall through */
+        case 'M': case 'm':
+            limit *= 1024;
+            /* fall through */
+        case 'K': case 'k':
+            limit *= 1024;
+            end++;
+            break;
+        }
+
+        if (end != item + item_len || limit > SIZE_MAX)
+            goto bad;
+
+        if (ct) {
+            body_limits[ct] = (size_t)limit;
+        }
+        else {
+            for (ct = CT_FORM_URLENCODED; ct < NR_CONTENT_TYPES; ct++)
+                body_limits[ct] = (size_t)limit;
+        }
+
+        item += item_len;
+        if (*item == ',')
+            item++;
+    }
+
+    return 0;
+
+bad:
+    syslog(LOG_ERR, "Bad limits of request bodies: %s\n", spec);
+    return -1;
+}
+
+/* The page cache is off unless TTLs are given. */
+static bool page_cache_on;
+static struct page_ttl default_page_ttl;
+static struct kvlist script_ttls;
+
+static int page_ttl_len(struct kvlist *kv, const void *data)
+{
+    (void)kv;
+    (void)data;
+    return sizeof(struct page_ttl);
+}
+
+/*
+ * Parses the TTLs in seconds of the pages in the page cache given in
+ * the form of `60,/srv/www/news.hvml=10+300`: a TTL without script applies
+ * to all scripts, and `+300` gives the grace period, in which the expired
+ * page is still served while being made again.  A script can also make its
+ * page cacheable with `Cache-Control`, which wins over the TTL given here.
+ */
+static int set_page_ttls(const char *spec)
+{
+    const char *item = spec;
+
+    kvlist_init(&script_ttls, page_ttl_len);
+    while (*item) {
+        size_t item_len = strcspn(item, ",");
+        const char *ttl = item;
+
+        const char *eq = memchr(item, '=', item_len);
+        if (eq) {
+            if (eq == item)
+                goto bad;
+            ttl = eq + 1;
+        }
+
+        char *end;
+        unsigned long value = strtoul(ttl, &end, 10);
+        if (end == ttl || value > UINT_MAX)
+            goto bad;
+
+        struct page_ttl v = { (unsigned)value, 0 };
+        if (*end == '+') {
+            const char *grace = end + 1;
+            value = strtoul(grace, &end, 10);
+            if (end == grace || value > UINT_MAX)
+                goto bad;
+            v.grace = (unsigned)value;
+        }
+
+        if (end != item + item_len)
+            goto bad;
+
+        if (eq) {
+            char *script = strndup(item, eq - item);
+            if (script == NULL || !kvlist_set(&script_ttls, script, &v)) {
+                free(script);
+                goto bad;
+            }
+            free(script);
+        }
+        else {
+            default_page_ttl = v;
+        }
+
+        item += item_len;
+        if (*item == ',')
+            item++;
+    }
+
+    page_cache_on = true;
+    /* hvml-fpm maps the cache before forking the workers */
+    return page_cache_init(PAGE_CACHE_DEF_SIZE);
+
+bad:
+    syslog(LOG_ERR, "Bad TTLs of the page cache: %s\n", spec);
+    kvlist_free(&script_ttls);
+    return -1;
+}
+
+static struct page_ttl get_script_ttl(const char *script)
+{
+    struct page_ttl *ttl = kvlist_get(&script_ttls, script);
+    return ttl ? *ttl : default_page_ttl;
+}
+
+/* The maximum content discarded to keep the connection to the server. */
+#define MAX_CONTENT_DISCARDED   (1024 * 1024)
+
+/*
+ * Discards the content not read.  If there is too much of it, gives up
+ * the connection instead, which libfcgi closes gracefully at the end of
+ * the request.
+ */
+static void discard_content(struct request_context *ctx, size_t length)
+{
+#ifdef NO_FCGI_DEFINES
+    char buf[4096];
+
+    while (length > 0) {
+        size_t n = fread(buf, 1,
+                (length < sizeof(buf)) ? length : sizeof(buf), ctx->in);
+        if (n == 0)
+            break;
+        length -= n;
+    }
+#else
+    if (ctx->in == NULL)
+        return;
+
+    if (length > MAX_CONTENT_DISCARDED) {
+        ctx->fcgx.keepConnection = 0;
+        return;
+    }
+
+    FCGX_SkipStr((int)length, ctx->in);
+#endif
+}
+
+/*
+ * The reader of the content of a request, which stops at the end of
+ * the content given by CONTENT_LENGTH.  When running as a FastCGI
+ * application, it reads straight from the buffer of the FastCGI input
+ * stream.
+ */
+struct content_reader {
+#ifdef NO_FCGI_DEFINES
+    FILE *in;
+#else
+    FCGX_Stream *in;
+#endif
+    size_t left;
+};
+
+static void init_content_reader(struct content_reader *reader,
+        struct request_context *ctx, size_t content_length)
+{
+    reader->in = ctx->in;
+    reader->left = content_length;
+}
+
+static ssize_t cb_content_read(void *ctxt, void *buf, size_t count)
+{
+    struct content_reader *reader = ctxt;
+    ssize_t n;
+
+    if (count > reader->left)
+        count = reader->left;
+    if (count > INT_MAX)
+        count = INT_MAX;
+    if (count == 0)
+        return 0;
+
+#ifdef NO_FCGI_DEFINES
+    n = fread(buf, 1, count, reader->in);
+#else
+    if (reader->in == NULL)
+        return -1;
+    n = FCGX_GetStr(buf, (int)count, reader->in);
+#endif
+
+    if (n > 0)
+        reader->left -= n;
+    return n;
+}
+
+/* Reads the whole content into buf, which holds at least length bytes. */
+static size_t read_content(struct request_context *ctx, char *buf, size_t length)
+{
+    struct content_reader reader;
+    size_t got = 0;
+
+    init_content_reader(&reader, ctx, length);
+    while (got < length) {
+        ssize_t n = cb_content_read(&reader, buf + got, length - got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+
+    return got;
+}
+
+/*
+ * Decodes a null-terminated form field in place: `+` becomes a space,
+ * and `%XX` the byte it stands for.  Returns the length of the result.
+ * Most of the fields have nothing to decode, so look for the first byte
+ * to decode with strcspn(), which libc vectorizes.
+ */
+static size_t decode_form_field(char *field)
+{
+    char *r = field + strcspn(field, "%+");
+    char *w = r;
+
+    while (*r) {
+        if (*r == '+') {
+            *w++ = ' ';
+            r++;
+        }
+        else if (*r == '%' && isxdigit((unsigned char)r[1]) &&
+                isxdigit((unsigned char)r[2])) {
+            char hex[3] = { r[1], r[2], 0 };
+            *w++ = (char)strtoul(hex, NULL, 16);
+            r += 3;
+        }
+        else {
+            *w++ = *r++;
+        }
+    }
+
+    *w = 0;
+    return w - field;
+}
+
+/*
+ * Adds a field to the object of the form.  The name and the value are
+ * copied, for the script may keep _POST after the request.  A field
+ * which is not valid UTF-8 is skipped.
+ */
+static bool add_form_field(purc_variant_t form, const char *name,
+        const char *value)
+{
+    purc_variant_t k = purc_variant_make_string(name, true);
+    purc_variant_t v = purc_variant_make_string(value, true);
+
+    bool success = true;
+    if (k == PURC_VARIANT_INVALID || v == PURC_VARIANT_INVALID) {
+        HFLOG_WARN("Skipped a form field not in UTF-8.\n");
+    }
+    else {
+        success = purc_variant_object_set(form, k, v);
+    }
+
+    if (k)
+        purc_variant_unref(k);
+    if (v)
+        purc_variant_unref(v);
+    return success;
+}
+
+/*
+ * Parses the content of application/x-www-form-urlencoded.  The fields
+ * are decoded in the buffer holding the content.
+ */
+static purc_variant_t parse_content_as_form_urlencoded(struct request_context *ctx,
+        size_t content_length)
+{
+    purc_variant_t v = PURC_VARIANT_INVALID;
+
+    char *buf = malloc(content_length + 1);
+    if (buf == NULL) {
+        HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+        return v;
+    }
+
+    if (read_content(ctx, buf, content_length) != content_length) {
+        HFLOG_ERROR("Mismatched content length and content got.\n");
+        goto failed;
+    }
+    buf[content_length] = 0;
+
+    v = purc_variant_make_object_0();
+    if (v == PURC_VARIANT_INVALID)
+        goto failed;
+
+    char *field = buf, *end = buf + content_length;
+    while (field < end) {
+        char *amp = memchr(field, '&', end - field);
+        if (amp == NULL)
+            amp = end;
+        *amp = 0;
+
+        char *value = memchr(field, '=', amp - field);
+        if (value) {
+            *value++ = 0;
+        }
+        else {
+            value = amp;
+        }
+
+        size_t name_len = decode_form_field(field);
+        decode_form_field(value);
+        if (name_len > 0 && !add_form_field(v, field, value)) {
+            HFLOG_ERROR("Failed when parsing content.\n");
+            purc_variant_unref(v);
+            v = PURC_VARIANT_INVALID;
+            goto failed;
+        }
+
+        field = amp + 1;
+    }
+
+failed:
+    free(buf);
+    return v;
+}
+
+static purc_variant_t parse_content_as_json(struct request_context *ctx,
+        size_t content_length)
+{
+    purc_variant_t v = PURC_VARIANT_INVALID;
+    struct content_reader reader;
+    purc_rwstream_t stm;
+
+    init_content_reader(&reader, ctx, content_length);
+    stm = purc_rwstream_new_for_read(&reader, cb_content_read);
+
+    if (stm) {
+        v = purc_variant_load_from_json_stream(stm);
+        purc_rwstream_destroy(stm);
+    }
+    else {
+        HFLOG_ERROR("Failed when making stream for the content\n");
+    }
+
+    return v;
+}
+
+static purc_variant_t parse_content_as_xml(struct request_context *ctx,
+        size_t content_length)
+{
+    purc_variant_t v = PURC_VARIANT_INVALID;
+    struct content_reader reader;
+    purc_rwstream_t stm;
+
+    init_content_reader(&reader, ctx, content_length);
+    stm = purc_rwstream_new_for_read(&reader, cb_content_read);
+
+    if (stm) {
+        v = purc_make_object_from_xml_stream(stm);
+        purc_rwstream_destroy(stm);
+    }
+    else {
+        HFLOG_ERROR("Failed when making stream for the content\n");
+    }
+
+    return v;
+}
+
+static int parse_content_as_form_data(struct request_context *ctx,
+        size_t content_length, const char *boundary,
+        purc_variant_t *post, purc_variant_t *files)
+{
+    struct content_reader reader;
+    purc_rwstream_t stm;
+
+    init_content_reader(&reader, ctx, content_length);
+    stm = purc_rwstream_new_for_read(&reader, cb_content_read);
+    if (stm == NULL) {
+        HFLOG_ERROR("Failed when making stream for the content\n");
+        return -1;
+    }
+
+    HFLOG_DEBUG("boundary: %s\n", boundary);
+    int ret = parse_content_as_multipart_form_data(stm, content_length,
+            boundary, post, files);
+    purc_rwstream_destroy(stm);
+    return ret;
+}
+
+static purc_variant_t parse_content_as_plain(struct request_context *ctx,
+        size_t content_length)
+{
+    purc_variant_t v = PURC_VARIANT_INVALID;
+
+    char *buf = malloc(content_length + 1);
+    if (buf) {
+        if (read_content(ctx, buf, content_length) == content_length) {
+            buf[content_length] = 0;
+
+            v = purc_variant_make_string_reuse_buff(buf, content_length + 1,
+                    true);
+            if (v == PURC_VARIANT_INVALID) {
+                HFLOG_ERROR("Failed when make string from content.\n");
+                goto failed;
+            }
+        }
+        else {
+            HFLOG_ERROR("Mismatched content length and content got.\n");
+            goto failed;
+        }
+    }
+    else {
+        HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+    }
+
+    return v;
+
+failed:
+    free(buf);
+    return v;
+}
+
+/*
+ * Parses a line of NDJSON and appends the value to the array.
+ * Empty lines (maybe with white spaces only) are skipped.
+ */
+static bool append_json_line(purc_variant_t array, const char *line,
+        size_t len)
+{
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+        len--;
+    while (len > 0 && isspace((unsigned char)*line)) {
+        line++;
+        len--;
+    }
+
+    if (len == 0)
+        return true;
+
+    purc_variant_t v = purc_variant_make_from_json_string(line, len);
+    if (v == PURC_VARIANT_INVALID) {
+        HFLOG_ERROR("Bad JSON line: %.*s\n", (int)len, line);
+        return false;
+    }
+
+    bool success = purc_variant_array_append(array, v);
+    purc_variant_unref(v);
+    return success;
+}
+
+#define NDJSON_CHUNK_SIZE       4096
+
+/*
+ * Parses the content of application/x-ndjson into an array.  The content
+ * is read in chunks and every line is parsed once it is complete, so only
+ * the line being read is buffered instead of the whole content.
+ */
+static purc_variant_t parse_content_as_ndjson(struct request_context *ctx,
+        size_t content_length)
+{
+    struct content_reader reader;
+    size_t buf_size = NDJSON_CHUNK_SIZE, len = 0;
+
+    purc_variant_t v = purc_variant_make_array_0();
+    if (v == PURC_VARIANT_INVALID)
+        return v;
+
+    char *buf = malloc(buf_size);
+    if (buf == NULL) {
+        HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+        goto failed;
+    }
+
+    init_content_reader(&reader, ctx, content_length);
+    for (;;) {
+        if (len == buf_size) {
+            /* a line longer than the buffer */
+            char *new_buf = realloc(buf, buf_size * 2);
+            if (new_buf == NULL) {
+                HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+                goto failed;
+            }
+            buf = new_buf;
+            buf_size *= 2;
+        }
+
+        ssize_t n = cb_content_read(&reader, buf + len, buf_size - len);
+        if (n <= 0)
+            break;
+
+        /* the bytes before buf + len contain no newline */
+        char *line = buf, *scan = buf + len, *end = buf + len + n;
+        char *nl;
+        while ((nl = memchr(scan, '\n', end - scan))) {
+            if (!append_json_line(v, line, nl - line))
+                goto failed;
+            line = scan = nl + 1;
+        }
+
+        len = end - line;
+        memmove(buf, line, len);
+    }
+
+    if (reader.left > 0) {
+        HFLOG_ERROR("Mismatched content length and content got.\n");
+        goto failed;
+    }
+
+    /* the last line may not end with a newline */
+    if (!append_json_line(v, buf, len))
+        goto failed;
+
+    free(buf);
+    return v;
+
+failed:
+    free(buf);
+    purc_variant_unref(v);
+    return PURC_VARIANT_INVALID;
+}
+
+/* Bodies of application/octet-stream larger than this go to a file. */
+#define MAX_OCTET_STREAM_IN_MEMORY  (1024 * 1024)
+
+#define OCTET_STREAM_CHUNK_SIZE     (16 * 1024)
+
+/*
+ * Writes the content to a temporary file described by *file.  Returns 0 on
+ * success, otherwise the HTTP status code for the failure.
+ */
+static int spill_content_to_file(struct request_context *ctx,
+        size_t content_length, purc_variant_t *file)
+{
+    int status = 500;
+
+    const char *upload_folder_path = HTTP_UPLOAD_PATH;
+    mkdir(upload_folder_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+
+    char template[] = HTTP_UPLOAD_FILE_TEMPLATE;
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        HFLOG_ERROR("Failed to create temporary file for content.\n");
+        return status;
+    }
+
+    FILE *fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        HFLOG_ERROR("Failed to open temporary file for content.\n");
+        close(fd);
+        goto failed;
+    }
+
+    struct content_reader reader;
+    char chunk[OCTET_STREAM_CHUNK_SIZE];
+    ssize_t n;
+
+    bool written = true;
+    init_content_reader(&reader, ctx, content_length);
+    while ((n = cb_content_read(&reader, chunk, sizeof(chunk))) > 0) {
+        if (fwrite(chunk, 1, n, fp) != (size_t)n) {
+            written = false;
+            break;
+        }
+    }
+
+    if (fclose(fp) != 0 || !written) {
+        HFLOG_ERROR("Failed when writing content to %s.\n", template);
+        goto failed;
+    }
+
+    if (reader.left > 0) {
+        HFLOG_ERROR("Mismatched content length and content got.\n");
+        status = 400;
+        goto failed;
+    }
+
+    *file = purc_variant_make_object_0();
+    if (*file == PURC_VARIANT_INVALID)
+        goto failed;
+
+    purc_variant_t tmp;
+    tmp = purc_variant_make_string_static("application/octet-stream", false);
+    purc_variant_object_set_by_static_ckey(*file, "type", tmp);
+    purc_variant_unref(tmp);
+
+    tmp = purc_variant_make_string(template, true);
+    purc_variant_object_set_by_static_ckey(*file, "tmp_name", tmp);
+    purc_variant_unref(tmp);
+
+    tmp = purc_variant_make_ulongint(content_length);
+    purc_variant_object_set_by_static_ckey(*file, "size", tmp);
+    purc_variant_unref(tmp);
+
+    return 0;
+
+failed:
+    unlink(template);
+    return status;
+}
+
+/*
+ * Parses the content of application/octet-stream.  A small content
+ * becomes a byte sequence as _POST; a larger one is written to a
+ * temporary file described by `_FILES.content`, in the same way as
+ * a file uploaded via multipart/form-data.
+ */
+/* Returns 0 on success, otherwise the HTTP status code for the failure. */
+static int parse_content_as_octet_stream(struct request_context *ctx,
+        size_t content_length, purc_variant_t *post, purc_variant_t *files)
+{
+    if (content_length > MAX_OCTET_STREAM_IN_MEMORY) {
+        purc_variant_t file = PURC_VARIANT_INVALID;
+        int status = spill_content_to_file(ctx, content_length, &file);
+        if (status)
+            return status;
+
+        *files = purc_variant_make_object_0();
+        if (*files)
+            purc_variant_object_set_by_static_ckey(*files, "content", file);
+        purc_variant_unref(file);
+        return *files ? 0 : 500;
+    }
+
+    char *buf = malloc(content_length);
+    if (buf == NULL) {
+        HFLOG_ERROR("Failed to allocate memory to hold content.\n");
+        return 500;
+    }
+
+    if (read_content(ctx, buf, content_length) != content_length) {
+        HFLOG_ERROR("Mismatched content length and content got.\n");
+        free(buf);
+        return 400;
+    }
+
+    *post = purc_variant_make_byte_sequence_reuse_buff(buf, content_length,
+            content_length);
+    if (*post == PURC_VARIANT_INVALID) {
+        HFLOG_ERROR("Failed when make byte sequence from content.\n");
+        free(buf);
+        return 500;
+    }
+
+    return 0;
+}
+
+static int release_request(struct request_info *info)
+{
+
+    if (info->server) {
+        purc_variant_unref(info->server);
+    }
+
+    if (info->get) {
+        purc_variant_unref(info->get);
+    }
+
+    if (info->post) {
+        purc_variant_unref(info->post);
+    }
+
+    if (info->cookie) {
+        purc_variant_unref(info->cookie);
+    }
+
+    if (info->files) {
+        purc_variant_unref(info->files);
+    }
+
+    if (info->response) {
+        purc_variant_unref(info->response);
+    }
+
+    if (info->request) {
+        purc_variant_unref(info->request);
+    }
+
+    memset(info, 0, sizeof(*info));
+    return 0;
+}
+
+/* The parameters used by the executor itself. */
+enum {
+    PARAM_REQUEST_METHOD = 0,
+    PARAM_QUERY_STRING,
+    PARAM_CONTENT_LENGTH,
+    PARAM_CONTENT_TYPE,
+    PARAM_HTTP_COOKIE,
+    PARAM_SCRIPT_FILENAME,
+    PARAM_HTTP_IF_NONE_MATCH,
+    PARAM_HTTP_ACCEPT_ENCODING,
+    PARAM_NR,
+};
+
+/* the names hashed once; lookups then probe the params index */
+static FCGX_ParamKey param_keys[PARAM_NR];
+
+/* Called before the executor threads start, which then only read the keys. */
+static void init_param_keys(void)
+{
+    static const char *names[PARAM_NR] = {
+        "REQUEST_METHOD",
+        "QUERY_STRING",
+        "CONTENT_LENGTH",
+        "CONTENT_TYPE",
+        "HTTP_COOKIE",
+        "SCRIPT_FILENAME",
+        "HTTP_IF_NONE_MATCH",
+        "HTTP_ACCEPT_ENCODING",
+    };
+
+    for (int i = 0; i < PARAM_NR; i++) {
+        FCGX_InitParamKey(&param_keys[i], names[i]);
+    }
+}
+
+static const char *get_param(struct request_context *ctx, int which)
+{
+#ifdef NO_FCGI_DEFINES
+    (void)ctx;
+    return FCGI_LookupParam(&param_keys[which], NULL);
+#else
+    return FCGX_LookupParam(&param_keys[which], &ctx->fcgx, NULL);
+#endif
+}
+
+static int get_param_count(struct request_context *ctx)
+{
+#ifdef NO_FCGI_DEFINES
+    (void)ctx;
+    return FCGI_GetParamCount();
+#else
+    return FCGX_GetParamCount(&ctx->fcgx);
+#endif
+}
+
+static int get_param_at(struct request_context *ctx, int i,
+        FCGX_Param *param)
+{
+#ifdef NO_FCGI_DEFINES
+    (void)ctx;
+    return FCGI_GetParamAt(i, param);
+#else
+    return FCGX_GetParamAt(&ctx->fcgx, i, param);
+#endif
+}
+
+static purc_variant_t build_server(struct request_context *ctx)
+{
+    purc_variant_t server = purc_variant_make_object_0();
+    if (server == PURC_VARIANT_INVALID) {
+        HFLOG_ERROR("Failed when making an object for %s\n", HVML_VAR_SERVER);
+        return PURC_VARIANT_INVALID;
+    }
+
+    /* The meta-variables having numeric values; all others are strings. */
+    static const struct numeric_var {
+        const char *name;
+        int len;
+    } numeric_vars[] = {
+
+        // This variable contains the size of the message-body attached to
+        // the request, if any, in decimal number of octets.
+        { "CONTENT_LENGTH", sizeof("CONTENT_LENGTH") - 1 },
+
+        // This variable MUST be set to the TCP/IP port number on
+        // which this request is received from the client.
+        { "SERVER_PORT", sizeof("SERVER_PORT") - 1 },
+
+        // The port the client is connected to on the server
+        // (not defined in RFC 3875).
+        { "REMOTE_PORT", sizeof("REMOTE_PORT") - 1 },
+    };
+    bool numeric_got[PCA_TABLESIZE(numeric_vars)] = { false };
+
+    /*
+     * Walk the parameters backwards, so that the first one wins when
+     * the server sent a name twice, like getenv() does.  The names and
+     * the values are copied: the memory of the parameters is reused by
+     * the next request, while the script may keep _SERVER or its values.
+     */
+    for (int i = get_param_count(ctx) - 1; i >= 0; i--) {
+        purc_variant_t tmp;
+        FCGX_Param param;
+        size_t j;
+
+        if (get_param_at(ctx, i, &param))
+            continue;
+
+        for (j = 0; j < PCA_TABLESIZE(numeric_vars); j++) {
+            if (param.nameLen == numeric_vars[j].len &&
+                    memcmp(param.name, numeric_vars[j].name,
+                        param.nameLen) == 0)
+                break;
+        }
+
+        if (j < PCA_TABLESIZE(numeric_vars)) {
+            unsigned long ul = strtoul(param.value, NULL, 10);
+            tmp = purc_variant_make_ulongint(ul);
+            numeric_got[j] = true;
+        }
+        else {
+            tmp = purc_variant_make_string(param.value, true);
+        }
+
+        if (tmp == PURC_VARIANT_INVALID) {
+            HFLOG_ERROR("Failed when making an variant for %s\n", param.name);
+            goto failed;
+        }
+
+        bool success = purc_variant_object_set_by_ckey(server,
+                param.name, tmp);
+        purc_variant_unref(tmp);
+        if (!success) {
+            HFLOG_ERROR("Failed when making a property for %s\n", param.name);
+            goto failed;
+        }
+    }
+
+    for (size_t j = 0; j < PCA_TABLESIZE(numeric_vars); j++) {
+        if (numeric_got[j])
+            continue;
+
+        purc_variant_t tmp = purc_variant_make_ulongint(0);
+        if (tmp == PURC_VARIANT_INVALID) {
+            HFLOG_ERROR("Failed when making a ulong 0 variant for %s\n",
+                    numeric_vars[j].name);
+            goto failed;
+        }
+
+        bool success = purc_variant_object_set_by_static_ckey(server,
+                numeric_vars[j].name, tmp);
+        purc_variant_unref(tmp);
+        if (!success) {
+            HFLOG_ERROR("Failed when making a property for %s\n",
+                    numeric_vars[j].name);
+            goto failed;
+        }
+    }
+
+#if 0
+    purc_variant_t tmp = purc_variant_make_longint(fileno(stdout));
+    if (tmp == PURC_VARIANT_INVALID) {
+        HFLOG_ERROR("Failed when making a ulong 0 variant for %s\n", "FCGIFD");
+        goto failed;
+    }
+    else {
+        bool success = purc_variant_object_set_by_static_ckey(server,
+                "FCGIFD", tmp);
+        purc_variant_unref(tmp);
+        if (!success) {
+            HFLOG_ERROR("Failed when making a property for %s\n", "FCGIFD");
+            goto failed;
+        }
+    }
+#endif
+
+    return server;
+
+failed:
+    purc_variant_unref(server);
+    return PURC_VARIANT_INVALID;
+}
+
+static purc_variant_t build_get(const char *query)
+{
+    if (query == NULL)
+        return purc_variant_make_object_0();
+
+    purc_variant_t get = purc_make_object_from_query_string(query, true);
+    if (get == PURC_VARIANT_INVALID) {
+        HFLOG_ERROR("Failed when parsing query string\n");
+    }
+    return get;
+}
+
+static purc_variant_t build_cookie(const char *cookie)
+{
+    if (cookie == NULL)
+        return purc_variant_make_object_0();
+
+    return purc_make_object_from_http_header_value(cookie);
+}
+
+/* The request variables which are built only for the pages using them. */
+enum {
+    USES_SERVER     = 0x01,
+    USES_GET        = 0x02,
+    USES_COOKIE     = 0x04,
+    USES_REQUEST    = 0x08,
+};
+
+static inline bool is_name_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+/* Tells whether the name appears in the text as a whole word. */
+static bool refers_to(const char *text, const char *name)
+{
+    size_t len = strlen(name);
+
+    for (const char *p = text; (p = strstr(p, name)); p += len) {
+        if ((p == text || !is_name_char(p[-1])) && !is_name_char(p[len]))
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * Reads the text of a page, and finds the request variables it uses.
+ * A script names a variable always by its name, so a variable whose name
+ * does not appear in the text is never accessed.
+ */
+static char *read_page(const char *script_name, unsigned *uses)
+{
+    char *text = NULL;
+    struct stat st;
+
+    if (script_name == NULL) {
+        HFLOG_ERROR("No SCRIPT_FILENAME given\n");
+        return NULL;
+    }
+
+    int fd = open(script_name, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) ||
+            (text = malloc(st.st_size + 1)) == NULL)
+        goto failed;
+
+    size_t len = 0;
+    while (len < (size_t)st.st_size) {
+        ssize_t n = read(fd, text + len, st.st_size - len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            goto failed;
+        if (n == 0)
+            break;
+        len += n;
+    }
+    text[len] = '\0';
+    close(fd);
+
+    *uses = 0;
+    if (refers_to(text, HVML_VAR_SERVER))
+        *uses |= USES_SERVER;
+    if (refers_to(text, HVML_VAR_GET))
+        *uses |= USES_GET;
+    if (refers_to(text, HVML_VAR_COOKIE))
+        *uses |= USES_COOKIE;
+    if (refers_to(text, HVML_VAR_REQUEST))
+        *uses |= USES_REQUEST;
+    return text;
+
+failed:
+    HFLOG_ERROR("Failed to read %s: %s\n", script_name, strerror(errno));
+    free(text);
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/* Returns 0 on success, otherwise the HTTP status code for the failure. */
+static int make_request(struct request_info *info, struct request_context *ctx)
+{
+    int status = 400;
+    unsigned uses;
+
+    const char *script_name = get_param(ctx, PARAM_SCRIPT_FILENAME);
+    char *text = read_page(script_name, &uses);
+    if (text == NULL)
+        goto failed;
+
+    if (uses & USES_SERVER) {
+        info->server = build_server(ctx);
+        if (info->server == PURC_VARIANT_INVALID)
+            goto failed;
+    }
+
+    const char *method = get_param(ctx, PARAM_REQUEST_METHOD);
+    if (method == NULL) {
+        HFLOG_ERROR("No REQUEST_METHOD given\n");
+        goto failed;
+    }
+
+    /* the query string is meaningful for all methods, e.g. POST /items?id=1 */
+    if (uses & (USES_GET | USES_REQUEST)) {
+        info->get = build_get(get_param(ctx, PARAM_QUERY_STRING));
+        if (info->get == PURC_VARIANT_INVALID)
+            goto failed;
+    }
+
+    /* a body may come with any method, e.g. PUT, PATCH, or DELETE */
+    const char *value = get_param(ctx, PARAM_CONTENT_LENGTH);
+    size_t content_length = value ? strtoul(value, NULL, 10) : 0;
+
+    if (content_length > 0) {
+        const char *content_type = get_param(ctx, PARAM_CONTENT_TYPE);
+        if (content_type == NULL) {
+            /* RFC 9110: the recipient may assume application/octet-stream */
+            content_type = "application/octet-stream";
+        }
+
+        enum post_content_type ct;
+        const char *boundary;
+        ct = check_post_content_type(content_type, &boundary);
+
+        if (ct <= 0) {
+            HFLOG_ERROR("not supported content type: %s\n", content_type);
+            goto failed;
+        }
+
+        if (content_length > body_limits[ct]) {
+            HFLOG_WARN("Too large %s body: %zu > %zu\n",
+                    body_limit_names[ct], content_length,
+                    body_limits[ct]);
+            discard_content(ctx, content_length);
+            status = 413;
+            goto failed;
+        }
+
+        switch (ct) {
+            case CT_FORM_URLENCODED:
+                info->post = parse_content_as_form_urlencoded(ctx,
+                        content_length);
+                if (info->post == PURC_VARIANT_INVALID)
+                    goto failed;
+                break;
+
+            case CT_FORM_DATA:
+                if (boundary) {
+                    if (parse_content_as_form_data(ctx, content_length,
+                                boundary, &info->post, &info->files))
+                        goto failed;
+                }
+                else {
+                    HFLOG_ERROR("No boundary defined.\n");
+                    goto failed;
+                }
+                break;
+
+            case CT_JSON:
+                info->post = parse_content_as_json(ctx, content_length);
+                if (info->post == PURC_VARIANT_INVALID)
+                    goto failed;
+                break;
+
+            case CT_XML:
+                info->post = parse_content_as_xml(ctx, content_length);
+                if (info->post == PURC_VARIANT_INVALID)
+                    goto failed;
+                break;
+
+            case CT_PLAIN:
+                info->post = parse_content_as_plain(ctx, content_length);
+                if (info->post == PURC_VARIANT_INVALID)
+                    goto failed;
+                break;
+
+            case CT_NDJSON:
+                info->post = parse_content_as_ndjson(ctx, content_length);
+                if (info->post == PURC_VARIANT_INVALID)
+                    goto failed;
+                break;
+
+            case CT_OCTET_STREAM: {
+                int err = parse_content_as_octet_stream(ctx, content_length,
+                        &info->post, &info->files);
+                if (err) {
+                    status = err;
+                    goto failed;
+                }
+                break;
+            }
+
+            case CT_BAD:
+                HFLOG_ERROR("Bad content type.\n");
+                goto failed;
+                break;
+
+            case CT_NOT_SUPPORTED:
+                HFLOG_ERROR("Not supported content type.\n");
+                goto failed;
+                break;
+        }
+    }
+
+    if (uses & (USES_COOKIE | USES_REQUEST)) {
+        info->cookie = build_cookie(get_param(ctx, PARAM_HTTP_COOKIE));
+        if (info->cookie == PURC_VARIANT_INVALID)
+            goto failed;
+    }
+
+    if (info->post == PURC_VARIANT_INVALID) {
+        info->post = purc_variant_make_object_0();
+    }
+    if (info->files == PURC_VARIANT_INVALID) {
+        info->files = purc_variant_make_object_0();
+    }
+
+    /* the script sets the status and the headers of the response here,
+       and appends to the stream what is sent after each run */
+    purc_variant_t resp_status = purc_variant_make_ulongint(200);
+    purc_variant_t resp_headers = purc_variant_make_object_0();
+    purc_variant_t resp_stream = purc_variant_make_array_0();
+    if (resp_status && resp_headers && resp_stream) {
+        info->response = purc_variant_make_object_by_static_ckey(3,
+                HVML_RESP_STATUS, resp_status,
+                HVML_RESP_HEADERS, resp_headers,
+                HVML_RESP_STREAM, resp_stream);
+    }
+    if (resp_status)
+        purc_variant_unref(resp_status);
+    if (resp_headers)
+        purc_variant_unref(resp_headers);
+    if (resp_stream)
+        purc_variant_unref(resp_stream);
+    if (info->response == PURC_VARIANT_INVALID)
+        goto failed;
+
+    /* a key of COOKIE wins over POST, which wins over GET */
+    if (uses & USES_REQUEST) {
+        info->request = purc_variant_make_object_0();
+        if (info->request == PURC_VARIANT_INVALID)
+            goto failed;
+
+        purc_variant_t layers[] = { info->get, info->post, info->cookie };
+        for (size_t i = 0; i < PCA_TABLESIZE(layers); i++) {
+            if (purc_variant_object_unite(info->request, layers[i],
+                        PCVRNT_CR_METHOD_OVERWRITE) < 0) {
+                HFLOG_ERROR("Failed to unite the request object.\n");
+                status = 500;
+                goto failed;
+            }
+        }
+    }
+
+    info->vdom = purc_load_hvml_from_string(text);
+    if (info->vdom == NULL) {
+        HFLOG_ERROR("Failed to load vDOM from %s.\n", script_name);
+        goto failed;
+    }
+
+    free(text);
+    return 0;
+
+failed:
+    free(text);
+    release_request(info);
+    return status;
+}
+
+static int init_cond_handler(purc_cond_k event, purc_coroutine_t cor,
+        void *data)
+{
+    if (event == PURC_COND_COR_ONE_RUN) {
+        struct purc_cor_run_info *info = (struct purc_cor_run_info *)data;
+        if (info->run_idx > 0) {
+            HFLOG_ERROR("The initialization script CANNOT use `observe`: %zu\n",
+                    info->run_idx);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (event == PURC_COND_COR_EXITED) {
+        HFLOG_INFO("The initialization script exited; waiting for request.\n");
+    }
+    else if (event == PURC_COND_COR_TERMINATED) {
+        struct purc_cor_term_info *info = (struct purc_cor_term_info *)data;
+        HFLOG_ERROR("The initialization teminated due to `%s`\n",
+                purc_atom_to_string(info->except));
+
+        struct runner_info *runner_info = NULL;
+        purc_get_local_data(RUNNER_INFO_NAME,
+                (uintptr_t *)(void *)&runner_info, NULL);
+        assert(runner_info);
+
+        const char *content;
+        content = ">> The executing stack frame(s):\n";
+        purc_rwstream_write(runner_info->dump_stm, content, strlen(content));
+        purc_coroutine_dump_stack(cor, runner_info->dump_stm);
+        purc_rwstream_write(runner_info->dump_stm, "\n", 2); // with null byte.
+
+        content = purc_rwstream_get_mem_buffer(runner_info->dump_stm, NULL);
+        HFLOG_INFO("%s", content);
+    }
+
+    return 0;
+}
+
+static int run_init_script(const char *init_script, const char *script_query)
+{
+    int ret = -1;
+    purc_variant_t request = PURC_VARIANT_INVALID;
+
+    if (script_query) {
+        request = purc_make_object_from_query_string(script_query, false);
+    }
+
+    purc_vdom_t vdom = purc_load_hvml_from_file(init_script);
+    if (vdom == NULL) {
+        HFLOG_ERROR("Failed to load vDOM from %s.\n", init_script);
+        goto failed;
+    }
+
+    purc_coroutine_t cor = purc_schedule_vdom(vdom, 0,
+            request, PCRDR_PAGE_TYPE_NULL, NULL, NULL, NULL,
+            NULL, NULL, NULL);
+    if (cor == NULL) {
+        HFLOG_ERROR("Failed to schedule the init script: %s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    if (purc_run((purc_cond_handler)init_cond_handler)) {
+        HFLOG_ERROR("Failed purc_run(): %s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    ret = 0;
+
+failed:
+    if (request) {
+        purc_variant_unref(request);
+    }
+
+    return ret;
+}
+
+static void send_resp(purc_rwstream_t stm, int status_code)
+{
+    const char *resp = NULL;
+
+    switch (status_code) {
+    case 400:
+        resp = "Status: 400 Bad Request\r\n"
+            "Content-Type: text/html\r\n\r\n"
+            "<html><body><h1>Bad Request</h1></body></html>";
+        break;
+    case 413:
+        resp = "Status: 413 Payload Too Large\r\n"
+            "Content-Type: text/html\r\n\r\n"
+            "<html><body><h1>Payload Too Large</h1></body></html>";
+        break;
+    case 500:
+        resp = "Status: 500 Internal Server Error\r\n"
+            "Content-Type: text/html\r\n\r\n"
+            "<html><body><h1>Internal Server Error</h1></body></html>";
+        break;
+    }
+
+    if (resp)
+        purc_rwstream_write(stm, resp, strlen(resp));
+}
+
+/*
+ * Starts the request accepted: sends the page in the page cache, or
+ * schedules the script as the main coroutine, whose user data is the
+ * runner.  The main coroutine is runner_info->main_crtn, NULL if none.
+ * Returns 0 on success, or -1 on an unrecoverable error.
+ */
+static int start_request(struct runner_info *runner_info,
+        struct request_info *request_info)
+{
+    struct request_context *ctx = runner_info->ctx;
+
+    /* only safe methods can be answered with 304 or from the cache */
+    const char *method = get_param(ctx, PARAM_REQUEST_METHOD);
+    bool safe = method && (strcasecmp(method, "GET") == 0 ||
+            strcasecmp(method, "HEAD") == 0);
+
+    runner_info->main_crtn = NULL;
+    runner_info->if_none_match = safe ?
+        get_param(ctx, PARAM_HTTP_IF_NONE_MATCH) : NULL;
+    runner_info->revalidating = false;
+    runner_info->head_sent = false;
+    runner_info->streaming = false;
+    runner_info->client_gone = false;
+    runner_info->coding = get_content_coding(
+            get_param(ctx, PARAM_HTTP_ACCEPT_ENCODING));
+
+    const char *script_name = get_param(ctx, PARAM_SCRIPT_FILENAME);
+    if (page_cache_on && safe && script_name) {
+        /* the compressed pages are other ones */
+        runner_info->cache_key = page_cache_make_key(script_name,
+                get_param(ctx, PARAM_QUERY_STRING),
+                content_codings[runner_info->coding]);
+        runner_info->cache_ttl = get_script_ttl(script_name);
+        runner_info->cache_lease = page_cache_new_lease();
+
+        /* waiting for the page blocks the runloop, and with it the other
+           requests and coroutines of the thread; a multiplexed request
+           makes the page as well instead */
+        unsigned max_wait = runner_info->multiplexed ? 0 : MAX_COALESCE_WAIT;
+
+        /* a hit costs neither loading nor running the script */
+        enum page_cache_result result = PAGE_CACHE_MISS;
+        if (runner_info->cache_key)
+            result = send_cached_page(runner_info->dump_stm,
+                    runner_info->cache_key, runner_info->cache_lease,
+                    runner_info->if_none_match, max_wait);
+        if (result == PAGE_CACHE_HIT) {
+            release_cache_key(runner_info);
+            return 0;
+        }
+
+        /* let the client have the expired page before making it again */
+        if (result == PAGE_CACHE_STALE) {
+            end_response(runner_info);
+            runner_info->revalidating = true;
+        }
+    }
+
+    int status = make_request(request_info, ctx);
+    if (status) {
+        send_resp(runner_info->dump_stm, status);
+        HFLOG_WARN("Failed to parse the request: %s\n",
+                purc_get_error_message(purc_get_last_error()));
+        release_cache_key(runner_info);
+        return 0;
+    }
+
+    purc_coroutine_t cor = purc_schedule_vdom(request_info->vdom, 0,
+            request_info->request,
+            PCRDR_PAGE_TYPE_NULL, NULL, NULL, NULL,
+            NULL, NULL, runner_info);
+    if (cor == NULL) {
+        HFLOG_ERROR("Failed to schedule a new vDOM: %s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    runner_info->main_crtn = cor;
+    runner_info->response = request_info->response;
+
+    /* bind _SERVER; it, _GET, and _COOKIE are only built if used */
+    if (request_info->server && !purc_coroutine_bind_variable(cor,
+                HVML_VAR_SERVER, request_info->server)) {
+        HFLOG_ERROR("Failed to bind " HVML_VAR_SERVER ": %s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    /* bind _GET */
+    if (request_info->get && !purc_coroutine_bind_variable(cor,
+                HVML_VAR_GET, request_info->get)) {
+        HFLOG_ERROR("Failed to bind " HVML_VAR_GET ": %s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    /* bind _POST */
+    if (!purc_coroutine_bind_variable(cor,
+                HVML_VAR_POST, request_info->post)) {
+        HFLOG_ERROR("Failed to bind " HVML_VAR_POST ":%s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    /* bind _COOKIE */
+    if (request_info->cookie && !purc_coroutine_bind_variable(cor,
+                HVML_VAR_COOKIE, request_info->cookie)) {
+        HFLOG_ERROR("Failed to bind " HVML_VAR_COOKIE ":%s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    /* bind _FILES */
+    if (!purc_coroutine_bind_variable(cor,
+                HVML_VAR_FILES, request_info->files)) {
+        HFLOG_ERROR("Failed to bind " HVML_VAR_FILES ":%s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    /* bind _RESPONSE */
+    if (!purc_coroutine_bind_variable(cor,
+                HVML_VAR_RESPONSE, request_info->response)) {
+        HFLOG_ERROR("Failed to bind " HVML_VAR_RESPONSE ":%s\n",
+                purc_get_error_message(purc_get_last_error()));
+        goto failed;
+    }
+
+    return 0;
+
+failed:
+    /* the coroutine, if scheduled, writes nothing after the end */
+    send_resp(runner_info->dump_stm, 500);
+    end_response(runner_info);
+    return -1;
+}
+
+/* Runs the requests accepted in the context of the runner one after another. */
+static int serve_requests(struct runner_info *runner_info,
+        int max_executions)
+{
+    int ret = EXIT_FAILURE;
+    int nr_executed = 0;
+
+    while (accept_request(runner_info->ctx) >= 0) {
+        struct request_info request_info = { };
+
+        if (start_request(runner_info, &request_info)) {
+            ret = EXIT_RETRY;
+            break;
+        }
+
+        if (runner_info->main_crtn == NULL)
+            continue;
+
+        if (purc_run((purc_cond_handler)prog_cond_handler)) {
+            send_resp(runner_info->dump_stm, 500);
+            HFLOG_ERROR("Failed purc_run(): %s\n",
+                    purc_get_error_message(purc_get_last_error()));
+            ret = EXIT_RETRY;
+            break;
+        }
+
+        release_request(&request_info);
+        release_cache_key(runner_info);
+
+        /* the run was aborted; see prog_cond_handler() */
+        if (runner_info->client_gone) {
+            HFLOG_WARN("The client of the stream has gone; quit...\n");
+            ret = EXIT_SUCCESS;
+            break;
+        }
+
+        nr_executed++;
+        if (nr_executed > max_executions) {
+            HFLOG_WARN("The number of total executions exceeds the limit (%d)\n",
+                    max_executions);
+            ret = EXIT_SUCCESS;
+            break;
+        }
+
+    } /* while */
+
+    release_cache_key(runner_info);
+    finish_request(runner_info->ctx);
+    return ret;
+}
+
+#ifndef NO_FCGI_DEFINES
+/*
+ * A request run along with others by the worker.  The runner is the first
+ * member, so that the user data of the main coroutine is the slot too.
+ */
+struct request_slot {
+    struct runner_info runner_info;
+    struct request_info request_info;
+    struct request_context ctx;
+    bool busy;
+
+    /* the client has gone, but the coroutine goes on observing */
+    bool stalled;
+};
+
+static __thread struct request_pool {
+    struct request_slot *slots;
+    int nr_slots;
+    int nr_busy;
+    int nr_stalled;
+
+    int nr_executed;
+    int max_executions;
+
+    /* the monitor of the listening socket; 0 if it is not watched */
+    uintptr_t monitor;
+
+    /* the monitor of the quitting pipe of the worker while running */
+    uintptr_t quit_monitor;
+
+    /* accepts no more requests, and quits with exit_code when idle */
+    bool quitting;
+    int exit_code;
+} pool;
+
+/*
+ * The requests run by all the threads of the worker, but the stalled ones.
+ * Once the stalled streams fill the slots of a thread, the worker accepts
+ * no more requests, asks the master for a new worker in its place, and
+ * quits when the others are done.
+ */
+static struct {
+    pthread_mutex_t lock;
+    int nr_running;
+    bool draining;
+
+    /* the master has been asked for a new worker */
+    bool replaced;
+
+    /* only stalled streams are left; all the threads stop */
+    bool quitting;
+
+    /* written once when quitting and never read, so that it wakes up
+       every thread, now or later */
+    int quit_fds[2];
+} worker = { PTHREAD_MUTEX_INITIALIZER, 0, false, false, false, { -1, -1 } };
+
+/* the process managing the workers; 0 if none */
+static pid_t master_pid;
+
+/*
+ * Nothing stops the stalled coroutines; tell the threads to stop their
+ * runloops and return, so that the worker quits when all are joined.
+ * Called while locked.
+ */
+static void quit_worker(void)
+{
+    if (worker.quitting)
+        return;
+
+    worker.quitting = true;
+    HFLOG_WARN("Only the streams whose clients have gone are left; "
+            "quit...\n");
+    if (write(worker.quit_fds[1], "q", 1) != 1)
+        HFLOG_ERROR("Failed to wake up the threads: %s\n", strerror(errno));
+}
+
+static void leave_running(void)
+{
+    pthread_mutex_lock(&worker.lock);
+    if (--worker.nr_running == 0 && worker.draining)
+        quit_worker();
+    pthread_mutex_unlock(&worker.lock);
+}
+
+/*
+ * The client of the slot has gone, but the coroutine goes on observing;
+ * the slot is taken for good.  Returns true if no slot is left.
+ */
+static bool stall_slot(struct request_slot *slot)
+{
+    slot->stalled = true;
+    pool.nr_stalled++;
+    leave_running();
 
-                switch (ct) {
-                    case CT_FORM_URLENCODED:
-                        info->post =
-                            parse_content_as_form_urlencoded(content_length);
-                        break;
-
-                    case CT_FORM_DATA:
-                        if (boundary) {
-                            printf("boundary: %s\n", boundary);
-                            parse_content_as_multipart_form_data(content_length,
-                                    boundary, &info->post, &info->files);
-                        }
-                        else {
-                            HFLOG_ERROR("No boundary defined.\n");
-                            goto failed;
-                        }
-                        break;
-
-                    case CT_JSON:
-                        info->post = parse_content_as_json(content_length);
-                        break;
-
-                    case CT_XML:
-                        /* TODO */
-                        info->post = parse_content_as_plain(content_length);
-                        break;
-
-                    case CT_PLAIN:
-                        info->post = parse_content_as_plain(content_length);
-                        break;
-
-                    case CT_BAD:
-                        HFLOG_ERROR("Bad content type.\n");
-                        goto failed;
-                        break;
+    if (pool.nr_stalled < pool.nr_slots)
+        return false;
 
-                    case CT_NOT_SUPPORTED:
-                        HFLOG_ERROR("Not supported content type.\n");
-                        goto failed;
-                        break;
-                }
-            }
-        }
+    pthread_mutex_lock(&worker.lock);
+    if (!worker.draining) {
+        worker.draining = true;
+
+        /* the requests of the other threads, e.g. streams, may take
+           long; let the master start a new worker at once */
+        if (worker.nr_running > 0 && master_pid > 0)
+            worker.replaced = (kill(master_pid, SIG_REPLACE_WORKER) == 0);
     }
+    if (worker.nr_running == 0)
+        quit_worker();
+    pthread_mutex_unlock(&worker.lock);
+    return true;
+}
 
-    const char *cookie =
-        purc_variant_get_string_const(
-                purc_variant_object_get_by_ckey(info->server, "HTTP_COOKIE"));
-    if (cookie) {
-        info->cookie = purc_make_object_from_http_header_value(cookie);
+static void quit_accepting(int exit_code)
+{
+    if (!pool.quitting) {
+        pool.quitting = true;
+        pool.exit_code = exit_code;
     }
+}
 
-    if (info->get == PURC_VARIANT_INVALID)
-        info->get = purc_variant_make_object_0();
-    if (info->post == PURC_VARIANT_INVALID) {
-        info->post = purc_variant_make_object_0();
+/* Finishes the request of the slot, and frees the slot for another one. */
+static void finish_slot(struct request_slot *slot)
+{
+    release_request(&slot->request_info);
+    release_cache_key(&slot->runner_info);
+    finish_request(&slot->ctx);
+
+    if (slot->stalled) {
+        slot->stalled = false;
+        pool.nr_stalled--;
     }
-    if (info->cookie == PURC_VARIANT_INVALID)
-        info->cookie = purc_variant_make_object_0();
-    if (info->files == PURC_VARIANT_INVALID) {
-        info->files = purc_variant_make_object_0();
+    else {
+        leave_running();
     }
+    slot->busy = false;
+    pool.nr_busy--;
+}
 
-    info->request = purc_variant_make_object_0();
-    /* merge properties of GET, POST, and COOKIE to request */
-    ssize_t nr = purc_variant_object_unite(info->request, info->get,
-            PCVRNT_CR_METHOD_OVERWRITE);
-    if (nr < 0) {
-        HFLOG_WARN("Failed to unite GET to REQ.\n");
-    }
+/*
+ * Accepts the requests waiting for the worker while there are free slots.
+ * The listening socket is non-blocking; no request is waiting when another
+ * worker took the connection.
+ */
+static void accept_requests(void)
+{
+    while (!pool.quitting && pool.nr_busy < pool.nr_slots) {
+        struct request_slot *slot = pool.slots;
+        while (slot->busy)
+            slot++;
+
+        /* counted while locked, lest the worker quit before running it */
+        pthread_mutex_lock(&worker.lock);
+        bool draining = worker.draining;
+        int rc = draining ? -EAGAIN : accept_request(&slot->ctx);
+        if (rc >= 0)
+            worker.nr_running++;
+        pthread_mutex_unlock(&worker.lock);
+
+        if (draining) {
+            quit_accepting(EXIT_SUCCESS);
+            break;
+        }
+
+        if (rc < 0) {
+            if (rc != -EAGAIN && rc != -EWOULDBLOCK && rc != -EINTR)
+                quit_accepting(EXIT_FAILURE);
+            break;
+        }
+
+        /* the next request on a kept connection would not be noticed */
+        slot->ctx.fcgx.keepConnection = 0;
+        slot->busy = true;
+        pool.nr_busy++;
+
+        if (start_request(&slot->runner_info, &slot->request_info))
+            quit_accepting(EXIT_RETRY);
 
-    nr = purc_variant_object_unite(info->request, info->post,
-            PCVRNT_CR_METHOD_OVERWRITE);
-    if (nr < 0) {
-        HFLOG_WARN("Failed to unite POST to REQ.\n");
+        /* otherwise, the slot is freed when the coroutine is destroyed */
+        if (slot->runner_info.main_crtn == NULL)
+            finish_slot(slot);
     }
+}
 
-    nr = purc_variant_object_unite(info->request, info->cookie,
-            PCVRNT_CR_METHOD_OVERWRITE);
-    if (nr < 0) {
-        HFLOG_WARN("Failed to unite COOKIE to REQ.\n");
+static bool on_listen_socket(int fd, purc_runloop_io_event event,
+        void *ctxt)
+{
+    (void)fd;
+    (void)event;
+    (void)ctxt;
+
+    accept_requests();
+    if (pool.quitting || pool.nr_busy == pool.nr_slots) {
+        /* watched again when a slot is freed */
+        pool.monitor = 0;
+        return false;
     }
 
-    const char *script_name =
-        purc_variant_get_string_const(
-                purc_variant_object_get_by_ckey(info->server, "SCRIPT_FILENAME"));
-    info->vdom = purc_load_hvml_from_file(script_name);
-    if (info->vdom == NULL) {
-        HFLOG_ERROR("Failed to load vDOM from %s.\n", script_name);
-        goto failed;
+    return true;
+}
+
+static void watch_listen_socket(void)
+{
+    if (pool.monitor == 0 && !pool.quitting && pool.nr_busy < pool.nr_slots) {
+        pool.monitor = purc_runloop_add_fd_monitor(purc_runloop_get_current(),
+                FCGI_LISTENSOCK_FILENO, PCRUNLOOP_IO_IN, on_listen_socket,
+                NULL);
     }
+}
 
-    return 0;
+static void unwatch_listen_socket(void)
+{
+    if (pool.monitor) {
+        purc_runloop_remove_fd_monitor(purc_runloop_get_current(),
+                pool.monitor);
+        pool.monitor = 0;
+    }
+}
 
-failed:
-    release_request(info);
-    return -1;
+/* The worker quits; the stalled coroutines are left to purc_cleanup(). */
+static bool on_quit_pipe(int fd, purc_runloop_io_event event, void *ctxt)
+{
+    (void)fd;
+    (void)event;
+    (void)ctxt;
+
+    quit_accepting(EXIT_SUCCESS);
+    unwatch_listen_socket();
+    pool.quit_monitor = 0;
+    purc_runloop_stop(purc_runloop_get_current());
+    return false;
 }
 
-static int init_cond_handler(purc_cond_k event, purc_coroutine_t cor,
+static int mux_cond_handler(purc_cond_k event, purc_coroutine_t cor,
         void *data)
 {
+    int ret = prog_cond_handler(event, cor, data);
+
+    struct request_slot *slot = NULL;
+    if (event == PURC_COND_COR_ONE_RUN || event == PURC_COND_COR_DESTROYED)
+        slot = purc_coroutine_get_user_data(cor);
+    if (slot == NULL)
+        return ret;
+
     if (event == PURC_COND_COR_ONE_RUN) {
-        struct purc_cor_run_info *info = (struct purc_cor_run_info *)data;
-        if (info->run_idx > 0) {
-            HFLOG_ERROR("The initialization script CANNOT use `observe`: %zu\n",
-                    info->run_idx);
-            exit(EXIT_FAILURE);
+        /* the other slots go on serving requests */
+        if (slot->runner_info.client_gone && !slot->stalled &&
+                stall_slot(slot)) {
+            quit_accepting(EXIT_SUCCESS);
+            unwatch_listen_socket();
         }
     }
-    else if (event == PURC_COND_COR_EXITED) {
-        HFLOG_INFO("The initialization script exited; waiting for request.\n");
-    }
-    else if (event == PURC_COND_COR_TERMINATED) {
-        struct purc_cor_term_info *info = (struct purc_cor_term_info *)data;
-        HFLOG_ERROR("The initialization teminated due to `%s`\n",
-                purc_atom_to_string(info->except));
-
-        struct runner_info *runner_info = NULL;
-        purc_get_local_data(RUNNER_INFO_NAME,
-                (uintptr_t *)(void *)&runner_info, NULL);
-        assert(runner_info);
+    else {
+        finish_slot(slot);
 
-        const char *content;
-        content = ">> The executing stack frame(s):\n";
-        purc_rwstream_write(runner_info->dump_stm, content, strlen(content));
-        purc_coroutine_dump_stack(cor, runner_info->dump_stm);
-        purc_rwstream_write(runner_info->dump_stm, "\n", 2); // with null byte.
+        pool.nr_executed++;
+        if (pool.nr_executed > pool.max_executions) {
+            HFLOG_WARN("The number of total executions exceeds the limit (%d)\n",
+                    pool.max_executions);
+            quit_accepting(EXIT_SUCCESS);
+        }
 
-        content = purc_rwstream_get_mem_buffer(runner_info->dump_stm, NULL);
-        HFLOG_INFO("%s", content);
+        if (pool.quitting)
+            unwatch_listen_socket();
+        else
+            watch_listen_socket();
     }
 
-    return 0;
+    return ret;
 }
 
-static int run_init_script(const char *init_script, const char *script_query)
+/* Called once by the worker before accepting with FCGX_Accept_r(). */
+static int init_listen_socket(void)
 {
-    int ret = -1;
-    purc_variant_t request = PURC_VARIANT_INVALID;
+    if (FCGX_Init()) {
+        syslog(LOG_ERR, "Failed FCGX_Init()\n");
+        return -1;
+    }
 
-    if (script_query) {
-        request = purc_make_object_from_query_string(script_query, false);
+    if (pipe(worker.quit_fds) == -1) {
+        syslog(LOG_ERR, "Failed to make the quitting pipe: %s\n",
+                strerror(errno));
+        return -1;
     }
 
-    purc_vdom_t vdom = purc_load_hvml_from_file(init_script);
-    if (vdom == NULL) {
-        HFLOG_ERROR("Failed to load vDOM from %s.\n", init_script);
-        goto failed;
+    /* never wait in accept() for the connection another worker took */
+    int flags = fcntl(FCGI_LISTENSOCK_FILENO, F_GETFL);
+    if (flags == -1 || fcntl(FCGI_LISTENSOCK_FILENO, F_SETFL,
+                flags | O_NONBLOCK) == -1) {
+        syslog(LOG_ERR, "Failed to make the listening socket "
+                "non-blocking: %s\n", strerror(errno));
+        return -1;
     }
 
-    purc_coroutine_t cor = purc_schedule_vdom(vdom, 0,
-            request, PCRDR_PAGE_TYPE_NULL, NULL, NULL, NULL,
-            NULL, NULL, NULL);
-    if (cor == NULL) {
-        HFLOG_ERROR("Failed to schedule the init script: %s\n",
-                purc_get_error_message(purc_get_last_error()));
-        goto failed;
+    return 0;
+}
+
+/*
+ * Runs up to nr_slots requests at a time: while the scripts of some wait
+ * for the data fetched or the timers, the others are accepted and run,
+ * each as its own main coroutine.
+ */
+static int serve_requests_concurrently(const struct runner_info *runner,
+        int nr_slots, int max_executions)
+{
+    pool.slots = calloc(nr_slots, sizeof(pool.slots[0]));
+    if (pool.slots == NULL) {
+        HFLOG_ERROR("Failed to allocate the slots of requests.\n");
+        return EXIT_FAILURE;
     }
 
-    if (purc_run((purc_cond_handler)init_cond_handler)) {
-        HFLOG_ERROR("Failed purc_run(): %s\n",
-                purc_get_error_message(purc_get_last_error()));
-        goto failed;
+    pool.nr_slots = nr_slots;
+    pool.max_executions = max_executions;
+    for (int i = 0; i < nr_slots; i++) {
+        struct request_slot *slot = pool.slots + i;
+
+        init_request_context(&slot->ctx);
+        slot->runner_info = *runner;
+        slot->runner_info.multiplexed = true;
+        slot->runner_info.ctx = &slot->ctx;
+        slot->runner_info.dump_stm = purc_rwstream_new_for_dump(&slot->ctx,
+                cb_output_write);
+        if (slot->runner_info.dump_stm == NULL) {
+            HFLOG_ERROR("Failed to make rwstream for a request.\n");
+            quit_accepting(EXIT_FAILURE);
+        }
     }
 
-    ret = 0;
+    while (!pool.quitting) {
+        /* nothing runs; wait for a connection, or for the worker to quit */
+        struct pollfd pfds[] = {
+            { FCGI_LISTENSOCK_FILENO, POLLIN, 0 },
+            { worker.quit_fds[0], POLLIN, 0 },
+        };
+        if (poll(pfds, PCA_TABLESIZE(pfds), -1) == -1) {
+            if (errno != EINTR)
+                quit_accepting(EXIT_FAILURE);
+            continue;
+        }
 
-failed:
-    if (request) {
-        purc_variant_unref(request);
+        if (pfds[1].revents) {
+            quit_accepting(EXIT_SUCCESS);
+            break;
+        }
+
+        accept_requests();
+        if (pool.nr_busy == 0)
+            continue;
+
+        /* returns when all the coroutines are done, or the worker quits */
+        pool.quit_monitor = purc_runloop_add_fd_monitor(
+                purc_runloop_get_current(), worker.quit_fds[0],
+                PCRUNLOOP_IO_IN, on_quit_pipe, NULL);
+        watch_listen_socket();
+        if (purc_run((purc_cond_handler)mux_cond_handler)) {
+            HFLOG_ERROR("Failed purc_run(): %s\n",
+                    purc_get_error_message(purc_get_last_error()));
+            quit_accepting(EXIT_RETRY);
+        }
+        unwatch_listen_socket();
+        if (pool.quit_monitor) {
+            purc_runloop_remove_fd_monitor(purc_runloop_get_current(),
+                    pool.quit_monitor);
+            pool.quit_monitor = 0;
+        }
     }
 
-    return ret;
-}
+    for (int i = 0; i < nr_slots; i++) {
+        struct request_slot *slot = pool.slots + i;
 
-static void send_resp(int status_code)
-{
-    switch (status_code) {
-    case 400:
-        fprintf(stdout, "Content-Type: text/html\r\n\r\n");
-        fprintf(stdout, "<html><body><h1>Bad Request</h1></body></html>");
-        break;
-    case 500:
-        fprintf(stdout, "Content-Type: text/html\r\n\r\n");
-        fprintf(stdout, "<html><body><h1>Internal Server Error</h1></body></html>");
-        break;
+        if (slot->busy) {
+            /* the stalled coroutine is destroyed after the slots */
+            if (slot->runner_info.main_crtn)
+                purc_coroutine_set_user_data(slot->runner_info.main_crtn,
+                        NULL);
+            finish_slot(slot);
+        }
+        if (slot->runner_info.dump_stm)
+            purc_rwstream_destroy(slot->runner_info.dump_stm);
     }
-}
 
+    free(pool.slots);
+    pool.slots = NULL;
 
-int hvml_executor(const char *app, const char *init_script,
-        const char *script_query, int max_executions, bool verbose)
+    /* quits for the stalled streams; the master may have replaced it */
+    pthread_mutex_lock(&worker.lock);
+    if (worker.quitting && worker.replaced && pool.exit_code == EXIT_SUCCESS)
+        pool.exit_code = EXIT_REPLACED;
+    pthread_mutex_unlock(&worker.lock);
+    return pool.exit_code;
+}
+#endif /* !NO_FCGI_DEFINES */
+
+static int init_instance(const char *app, const char *runner, bool verbose)
 {
     unsigned int modules = 0;
     modules = (PURC_MODULE_HVML | PURC_MODULE_PCRDR) | PURC_HAVE_FETCHER_R;
 
-    char runner[PURC_LEN_RUNNER_NAME + 1];
-    int n = snprintf(runner, sizeof(runner), HVML_RUN_NAME, getpid());
-    if (n < 0 || (size_t)n >= sizeof(runner)) {
-        syslog(LOG_ERR, "Failed to make runner name.\n");
-        return EXIT_FAILURE;
-    }
-
     purc_instance_extra_info extra_info = {};
     extra_info.renderer_comm = PURC_RDRCOMM_HEADLESS;
     extra_info.renderer_uri = DEF_RDR_URI_HEADLESS;
@@ -807,7 +3389,7 @@ int hvml_executor(const char *app, const char *init_script,
     if (ret != PURC_ERROR_OK) {
         syslog(LOG_ERR, "Failed to initialize the PurC instance: %s\n",
             purc_get_error_message(ret));
-        return EXIT_FAILURE;
+        return -1;
     }
 
     if (verbose) {
@@ -818,8 +3400,18 @@ int hvml_executor(const char *app, const char *init_script,
         purc_enable_log_ex(PURC_LOG_MASK_DEFAULT, PURC_LOG_FACILITY_SYSLOG);
     }
 
-    ret = EXIT_FAILURE;
+    return 0;
+}
 
+/*
+ * Runs the initialization script, then serves the requests in the PurC
+ * instance of the calling thread, which is one of several if threaded.
+ */
+static int run_executor(struct runner_info *runner_info,
+        const char *init_script, const char *script_query,
+        int max_requests, bool threaded, int max_executions)
+{
+    int ret;
     purc_rwstream_t dump_stm;
     dump_stm = purc_rwstream_new_buffer(512, 4096);
     if (dump_stm == NULL) {
@@ -827,129 +3419,244 @@ int hvml_executor(const char *app, const char *init_script,
         return EXIT_FAILURE;
     }
 
-    struct runner_info runner_info = { verbose, NULL, dump_stm };
-    purc_set_local_data(RUNNER_INFO_NAME, (uintptr_t)&runner_info, NULL);
+    runner_info->dump_stm = dump_stm;
+    purc_set_local_data(RUNNER_INFO_NAME, (uintptr_t)runner_info, NULL);
 
     if (init_script && run_init_script(init_script, script_query)) {
         HFLOG_ERROR("Failed run_init_script(); exit...\n");
+        purc_rwstream_destroy(dump_stm);
         return EXIT_FAILURE;
     }
 
     purc_rwstream_destroy(dump_stm);
-    dump_stm = purc_rwstream_new_for_dump(stdout, cb_stdio_write);
-    if (dump_stm == NULL) {
-        HFLOG_ERROR("Failed to make rwstream on stdout.\n");
+
+#ifndef NO_FCGI_DEFINES
+    /* hvml-fpm always hands a listening socket to the workers; running
+       as a plain CGI program, with the request on stdin and in environ,
+       is not supported */
+    if (FCGX_IsCGI()) {
+        HFLOG_ERROR("Not started on a FastCGI listening socket; "
+                "CGI is not supported.\n");
         return EXIT_FAILURE;
     }
 
-    runner_info.dump_stm = dump_stm;
-
-    int nr_executed = 0;
-    while (FCGI_Accept() >= 0) {
-        struct request_info request_info = { };
+    /* every slot has its own stream; the threads share the listening
+       socket initialized before they start */
+    if (threaded || max_requests > 1) {
+        if (!threaded && init_listen_socket())
+            ret = EXIT_FAILURE;
+        else
+            ret = serve_requests_concurrently(runner_info,
+                    max_requests > 1 ? max_requests : 1, max_executions);
+    }
+    else
+#else
+    (void)max_requests;
+    (void)threaded;
+#endif
+    {
+        struct request_context ctx;
 
-        if ((ret = make_request(&request_info))) {
-            send_resp(400);
-            HFLOG_WARN("Failed to parse the request: %s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            continue;
+#ifndef NO_FCGI_DEFINES
+        if (FCGX_Init()) {
+            HFLOG_ERROR("Failed FCGX_Init()\n");
+            return EXIT_FAILURE;
         }
+#endif
 
-        purc_coroutine_t cor = purc_schedule_vdom(request_info.vdom, 0,
-                request_info.request,
-                PCRDR_PAGE_TYPE_NULL, NULL, NULL, NULL,
-                NULL, NULL, NULL);
-        if (cor == NULL) {
-            HFLOG_ERROR("Failed to schedule a new vDOM: %s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            send_resp(500);
-            ret = EXIT_RETRY;
-            break;
+        init_request_context(&ctx);
+        dump_stm = purc_rwstream_new_for_dump(&ctx, cb_output_write);
+        if (dump_stm == NULL) {
+            HFLOG_ERROR("Failed to make rwstream for the requests.\n");
+            return EXIT_FAILURE;
         }
 
-        /* bind _SERVER */
-        if (!purc_coroutine_bind_variable(cor, HVML_VAR_SERVER,
-                    request_info.server)) {
-            send_resp(500);
-            HFLOG_ERROR("Failed to bind " HVML_VAR_SERVER ": %s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            ret = EXIT_RETRY;
-            break;
-        }
+        runner_info->ctx = &ctx;
+        runner_info->dump_stm = dump_stm;
+        ret = serve_requests(runner_info, max_executions);
+        runner_info->ctx = NULL;
+        purc_rwstream_destroy(dump_stm);
+    }
 
-        /* bind _GET */
-        if (!purc_coroutine_bind_variable(cor,
-                    HVML_VAR_GET, request_info.get)) {
-            send_resp(500);
-            HFLOG_ERROR("Failed to bind " HVML_VAR_GET ": %s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            ret = EXIT_RETRY;
-            break;
-        }
+    if (ret == EXIT_FAILURE) {
+        HFLOG_ERROR("Failed to accept requests, quit...\n");
+    }
+    else if (ret == EXIT_SUCCESS) {
+        HFLOG_ERROR("Quitting due to resource limit...\n");
+    }
+    else if (ret == EXIT_REPLACED) {
+        HFLOG_ERROR("Quitting for another worker in place...\n");
+    }
+    else {
+        HFLOG_ERROR("Encountered an unrecoverable error; exit...\n");
+    }
 
-        /* bind _POST */
-        if (!purc_coroutine_bind_variable(cor,
-                    HVML_VAR_POST, request_info.post)) {
-            send_resp(500);
-            HFLOG_ERROR("Failed to bind " HVML_VAR_POST ":%s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            ret = EXIT_RETRY;
-            break;
-        }
+    return ret;
+}
 
-        /* bind _COOKIE */
-        if (!purc_coroutine_bind_variable(cor,
-                    HVML_VAR_COOKIE, request_info.cookie)) {
-            send_resp(500);
-            HFLOG_ERROR("Failed to bind " HVML_VAR_COOKIE ":%s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            ret = EXIT_RETRY;
-            break;
-        }
+#ifndef NO_FCGI_DEFINES
+struct executor_thread {
+    pthread_t id;
+    unsigned index;
+    int ret;
 
-        /* bind _FILES */
-        if (!purc_coroutine_bind_variable(cor,
-                    HVML_VAR_FILES, request_info.files)) {
-            send_resp(500);
-            HFLOG_ERROR("Failed to bind " HVML_VAR_FILES ":%s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            ret = EXIT_RETRY;
-            break;
-        }
+    const char *app;
+    const char *init_script;
+    const char *script_query;
+    int max_requests;
+    int max_executions;
 
-        runner_info.main_crtn = cor;
-        if (purc_run((purc_cond_handler)prog_cond_handler)) {
-            send_resp(500);
-            HFLOG_ERROR("Failed purc_run(): %s\n",
-                    purc_get_error_message(purc_get_last_error()));
-            ret = EXIT_RETRY;
+    struct runner_info runner_info;
+};
+
+static void *executor_thread(void *arg)
+{
+    struct executor_thread *thread = arg;
+
+    char runner[PURC_LEN_RUNNER_NAME + 1];
+    int n = snprintf(runner, sizeof(runner), HVML_THREAD_RUN_NAME,
+            getpid(), thread->index);
+    if (n < 0 || (size_t)n >= sizeof(runner)) {
+        syslog(LOG_ERR, "Failed to make runner name.\n");
+        thread->ret = EXIT_FAILURE;
+        return NULL;
+    }
+
+    if (init_instance(thread->app, runner, thread->runner_info.verbose)) {
+        thread->ret = EXIT_FAILURE;
+        return NULL;
+    }
+
+    thread->ret = run_executor(&thread->runner_info, thread->init_script,
+            thread->script_query, thread->max_requests, true,
+            thread->max_executions);
+
+    page_cache_thread_cleanup();
+    purc_cleanup();
+    return NULL;
+}
+
+/*
+ * Runs an executor in each of nr_threads threads, with its own PurC
+ * instance and requests; the threads share the settings, which are not
+ * changed any more, and the page cache.  The executions are shared out.
+ */
+static int run_executor_threads(const struct runner_info *runner,
+        const char *app, const char *init_script, const char *script_query,
+        int max_requests, int nr_threads, int max_executions)
+{
+    if (init_listen_socket())
+        return EXIT_FAILURE;
+
+    struct executor_thread *threads = calloc(nr_threads, sizeof(threads[0]));
+    if (threads == NULL) {
+        syslog(LOG_ERR, "Failed to allocate the executor threads.\n");
+        return EXIT_FAILURE;
+    }
+
+    int nr_started = 0;
+    for (int i = 0; i < nr_threads; i++) {
+        struct executor_thread *thread = threads + i;
+
+        thread->index = i;
+        thread->app = app;
+        thread->init_script = init_script;
+        thread->script_query = script_query;
+        thread->max_requests = max_requests;
+        thread->max_executions = max_executions / nr_threads;
+        if (thread->max_executions < 1)
+            thread->max_executions = 1;
+        thread->runner_info = *runner;
+
+        int err = pthread_create(&thread->id, NULL, executor_thread, thread);
+        if (err) {
+            syslog(LOG_ERR, "Failed to create executor thread: %s\n",
+                    strerror(err));
             break;
         }
+        nr_started++;
+    }
 
-        release_request(&request_info);
+    /* the first failure of the threads is the one of the worker */
+    int ret = nr_started ? EXIT_SUCCESS : EXIT_FAILURE;
+    for (int i = 0; i < nr_started; i++) {
+        pthread_join(threads[i].id, NULL);
+        if (ret == EXIT_SUCCESS)
+            ret = threads[i].ret;
+    }
 
-        nr_executed++;
-        if (nr_executed > max_executions) {
-            HFLOG_WARN("The number of total executions exceeds the limit (%d)\n",
-                    max_executions);
-            ret = EXIT_SUCCESS;
-            break;
+    free(threads);
+    return ret;
+}
+#endif /* !NO_FCGI_DEFINES */
+
+int hvml_executor(const char *app, const char *init_script,
+        const char *script_query, const char *limits, bool auto_etag,
+        const char *page_ttls, const char *compression, bool progressive,
+        int max_requests, int nr_threads, int max_executions, pid_t master,
+        bool verbose)
+{
+    /* every executor thread has its own instance; none is needed here */
+    bool threaded = false;
+#ifndef NO_FCGI_DEFINES
+    threaded = (nr_threads > 1);
+#endif
+
+    if (!threaded) {
+        char runner[PURC_LEN_RUNNER_NAME + 1];
+        int n = snprintf(runner, sizeof(runner), HVML_RUN_NAME, getpid());
+        if (n < 0 || (size_t)n >= sizeof(runner)) {
+            syslog(LOG_ERR, "Failed to make runner name.\n");
+            return EXIT_FAILURE;
         }
 
-    } /* while */
+        if (init_instance(app, runner, verbose)) {
+            return EXIT_FAILURE;
+        }
+    }
 
-    if (ret == EXIT_FAILURE) {
-        HFLOG_ERROR("Failed FCGI_Accept(), quit...\n");
+    if (limits && set_body_limits(limits)) {
+        return EXIT_FAILURE;
     }
-    else if (ret == EXIT_SUCCESS) {
-        HFLOG_ERROR("Quitting due to resource limit...\n");
+
+    if (page_ttls && set_page_ttls(page_ttls)) {
+        return EXIT_FAILURE;
     }
-    else {
-        HFLOG_ERROR("Encountered an unrecoverable error; exit...\n");
+
+    if (compression && set_compression(compression)) {
+        return EXIT_FAILURE;
     }
 
-    purc_cleanup();
-    purc_rwstream_destroy(dump_stm);
+    progressive_output = progressive;
+    init_param_keys();
+#ifndef NO_FCGI_DEFINES
+    master_pid = master;
+#else
+    (void)master;
+#endif
+
+    struct runner_info runner_info = { verbose, NULL, NULL, NULL,
+        auto_etag, NULL, NULL, 0, { 0, 0 }, false, CC_IDENTITY, false,
+        false, false, false, NULL };
+
+    int ret;
+#ifndef NO_FCGI_DEFINES
+    if (threaded)
+        ret = run_executor_threads(&runner_info, app, init_script,
+                script_query, max_requests, nr_threads, max_executions);
+    else
+#else
+    (void)nr_threads;
+#endif
+        ret = run_executor(&runner_info, init_script, script_query,
+                max_requests, false, max_executions);
+
+    if (page_cache_on) {
+        page_cache_cleanup();
+        kvlist_free(&script_ttls);
+    }
+
+    if (!threaded)
+        purc_cleanup();
     return ret;
 }
-
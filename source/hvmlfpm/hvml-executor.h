@@ -25,10 +25,13 @@
 #ifndef hvml_executor_h
 #define hvml_executor_h
 
+#include <sys/types.h>
+#include <signal.h>
 #include <purc/purc.h>
 
 #define DEF_RDR_URI_HEADLESS    "file:///dev/null"
 #define HVML_RUN_NAME           "fpmworker%u"
+#define HVML_THREAD_RUN_NAME    "fpmworker%ut%u"
 
 /* The reserved variables */
 #define HVML_VAR_SERVER         "_SERVER"
@@ -36,6 +39,15 @@
 #define HVML_VAR_POST           "_POST"
 #define HVML_VAR_COOKIE         "_COOKIE"
 #define HVML_VAR_FILES          "_FILES"
+#define HVML_VAR_RESPONSE       "_RESPONSE"
+
+/* The properties of _RESPONSE */
+#define HVML_RESP_STATUS        "status"
+#define HVML_RESP_HEADERS       "headers"
+#define HVML_RESP_STREAM        "stream"
+
+/* The variable of the request given by PurC */
+#define HVML_VAR_REQUEST        "REQ"
 
 #define HTTP_CONTENT_TYPE           "Content-Type"
 #define HTTP_CONTENT_DISPOSITION    "Content-Disposition"
@@ -70,12 +82,21 @@
 
 #define EXIT_RETRY      1
 
+/* the worker quits after the master started another in its place */
+#define EXIT_REPLACED   2
+
+/* sent by a draining worker to the master for a new worker */
+#define SIG_REPLACE_WORKER  SIGUSR1
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int hvml_executor(const char *app, const char *init_script,
-        const char *script_query, int max_executions, bool verbose);
+        const char *script_query, const char *limits, bool auto_etag,
+        const char *page_ttls, const char *compression, bool progressive,
+        int max_requests, int nr_threads, int max_executions, pid_t master,
+        bool verbose);
 
 #ifdef __cplusplus
 }
@@ -66,6 +66,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <signal.h>
 
 #if HAVE(PWD_H)
 # include <grp.h>
@@ -93,6 +94,7 @@
 
 #include "hvml-fpm.h"
 #include "hvml-executor.h"
+#include "page-cache.h"
 
 /* for solaris 2.5 and netbsd 1.3.x */
 #if !HAVE(SOCKLEN_T)
@@ -300,8 +302,28 @@ bind_socket(const char *addr, unsigned short port, const char *unixsocket,
     return fcgi_fd;
 }
 
+/*
+ * The signals the master waits for: a worker exited, or a draining worker
+ * asks for another one in its place.  They stay blocked, so that none is
+ * missed between reaping the workers and waiting; the workers get the
+ * signal mask back.
+ */
+static sigset_t master_signals;
+static sigset_t worker_sigmask;
+
+static int block_master_signals(void)
+{
+    sigemptyset(&master_signals);
+    sigaddset(&master_signals, SIGCHLD);
+    sigaddset(&master_signals, SIG_REPLACE_WORKER);
+    return sigprocmask(SIG_BLOCK, &master_signals, &worker_sigmask);
+}
+
 static void call_executor(const char *hvmlApp, const char *initScript,
-        const char *scriptQuery, int fcgi_fd, int max_executions)
+        const char *scriptQuery, const char *bodyLimits, int autoEtag,
+        const char *pageTtls, const char *compression, int progressive,
+        int maxRequests, int nrThreads, int fcgi_fd, int max_executions,
+        pid_t master)
 {
     int max_fd = 0;
     int i = 0;
@@ -335,14 +357,17 @@ static void call_executor(const char *hvmlApp, const char *initScript,
             close(i);
     }
 
-    exit(hvml_executor(hvmlApp, initScript, scriptQuery,
-                max_executions, true));
+    exit(hvml_executor(hvmlApp, initScript, scriptQuery, bodyLimits,
+                autoEtag, pageTtls, compression, progressive, maxRequests,
+                nrThreads, max_executions, master, true));
 }
 
 static int
 fcgi_spawn_connection(const char *hvmlApp, const char *initScript,
-        const char *scriptQuery, int fcgi_fd, int fork_count, int pid_fd,
-        int max_executions)
+        const char *scriptQuery, const char *bodyLimits, int autoEtag,
+        const char *pageTtls, const char *compression, int progressive,
+        int maxRequests, int nrThreads, int fcgi_fd, int fork_count,
+        int pid_fd, int max_executions)
 {
     int status, rc = 0;
     struct timeval tv = { 0, 100 * 1000 };
@@ -356,8 +381,11 @@ fcgi_spawn_connection(const char *hvmlApp, const char *initScript,
             child = fork();
 
             if (child == 0) {
-                call_executor(hvmlApp, initScript, scriptQuery, fcgi_fd,
-                        max_executions);
+                sigprocmask(SIG_SETMASK, &worker_sigmask, NULL);
+                call_executor(hvmlApp, initScript, scriptQuery, bodyLimits,
+                        autoEtag, pageTtls, compression, progressive,
+                        maxRequests, nrThreads, fcgi_fd, max_executions,
+                        getppid());
             }
             else if (child > 0) {
                 /* father */
@@ -425,8 +453,9 @@ fcgi_spawn_connection(const char *hvmlApp, const char *initScript,
     }
     else {
         /* no fork */
-        call_executor(hvmlApp, initScript, scriptQuery, fcgi_fd,
-                max_executions);
+        call_executor(hvmlApp, initScript, scriptQuery, bodyLimits,
+                autoEtag, pageTtls, compression, progressive, maxRequests,
+                nrThreads, fcgi_fd, max_executions, 0);
     }
 
     return rc;
@@ -525,6 +554,32 @@ static void show_help (void)
         " -P <path>         name of PID-file for spawned worker processes\n"
         " -e                the maximum number of total executions\n"
         "                       (default 1000)\n"
+        " -E                make strong ETags for the responses and answer\n"
+        "                       304 Not Modified on a matched If-None-Match\n"
+        " -T <ttls>         cache whole pages for GET and HEAD requests;\n"
+        "                       TTLs in seconds, e.g. 60,/srv/www/news.hvml=10;\n"
+        "                       +<grace> serves the expired page for <grace>\n"
+        "                       seconds more while making it again, e.g. 60+300;\n"
+        "                       Cache-Control set by the script wins\n"
+        " -z <settings>     compress responses with gzip or deflate as\n"
+        "                       accepted by the client; the zlib level (1-9)\n"
+        "                       and the minimal body size, e.g. 6,1K\n"
+        "                       (default size 1K)\n"
+        " -f                send the head of an HTML page as soon as the\n"
+        "                       first run of the page ends, not waiting for\n"
+        "                       the observers; not with -E, -T, or -z\n"
+        " -r <requests>     number of requests a worker runs at the same\n"
+        "                       time, the others going on while a page waits\n"
+        "                       for data or timers (default 1)\n"
+        " -t <threads>      number of threads of a worker, each running its\n"
+        "                       own HVML interpreter; the threads share the\n"
+        "                       settings and the page cache (default 1)\n"
+        " -m <size>         size of the page cache shared by the workers\n"
+        "                       (default 64M, at most 16G)\n"
+        " -l <limits>       limits of request bodies, e.g. 8M,form-data=64M;\n"
+        "                       names: urlencoded, form-data, json, xml, plain,\n"
+        "                       ndjson, octet-stream\n"
+        "                       (default 8M,form-data=64M,octet-stream=64M)\n"
         " -v                show version\n"
         " -?, -h            show this help\n"
         "(root only)\n" \
@@ -539,6 +594,33 @@ static void show_help (void)
     ));
 }
 
+/*
+ * Parses a size in bytes with an optional suffix K, M, or G; returns 0 if
+ * the size is not valid, or is not between 1 and max.
+ */
+static size_t parse_size(const char *str, unsigned long long max)
+{
+    char *endptr;
+
+    errno = 0;
+    unsigned long long size = strtoull(str, &endptr, 10);
+    if (errno || endptr == str || *str == '-')
+        return 0;
+
+    unsigned long long unit = 1;
+    switch (*endptr) {
+    case 'G': case 'g': unit = 1024ULL * 1024 * 1024; endptr++; break;
+    case 'M': case 'm': unit = 1024ULL * 1024; endptr++; break;
+    case 'K': case 'k': unit = 1024ULL; endptr++; break;
+    }
+
+    if (*endptr || size == 0 || size > max / unit ||
+            size * unit > (size_t)-1)
+        return 0;
+
+    return (size_t)(size * unit);
+}
+
 static int daemonize(void)
 {
     pid_t pid;
@@ -570,10 +652,10 @@ static int daemonize(void)
 int main(int argc, char **argv)
 {
     char *hvml_app = NULL, *init_script = NULL, *script_query = NULL,
-         *changeroot = NULL, *username = NULL,
+         *body_limits = NULL, *changeroot = NULL, *username = NULL,
          *groupname = NULL, *unixsocket = NULL, *pid_file = NULL,
          *sockusername = NULL, *sockgroupname = NULL, *fcgi_dir = NULL,
-         *addr = NULL;
+         *addr = NULL, *page_ttls = NULL, *compression = NULL;
     char *endptr = NULL;
     unsigned short port = 0;
     mode_t sockmode =  (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP) & ~read_umask();
@@ -583,6 +665,11 @@ int main(int argc, char **argv)
     int i_am_root, o;
     int pid_fd = -1;
     int sockbeforechroot = 0;
+    int auto_etag = 0;
+    int progressive = 0;
+    int max_requests = 1;
+    int nr_threads = 1;
+    size_t page_cache_size = PAGE_CACHE_DEF_SIZE;
     struct sockaddr_un un;
     int fcgi_fd = -1;
 
@@ -594,11 +681,37 @@ int main(int argc, char **argv)
     i_am_root = (getuid() == 0);
 
     while (-1 != (o = getopt(argc, argv,
-                    "c:d:A:i:q:g:?ha:p:b:u:vC:F:e:s:P:U:G:M:S"))) {
+                    "c:d:A:i:q:l:g:?ha:p:b:u:vC:F:e:s:P:U:G:M:SET:m:z:fr:t:"))) {
         switch(o) {
         case 'A': hvml_app = optarg; break;
         case 'i': init_script = optarg; break;
         case 'q': script_query = optarg; break;
+        case 'l': body_limits = optarg; break;
+        case 'E': auto_etag = 1; break;
+        case 'T': page_ttls = optarg; break;
+        case 'z': compression = optarg; break;
+        case 'f': progressive = 1; break;
+        case 'r': max_requests = strtol(optarg, &endptr, 10);
+            if (*endptr || endptr == optarg || max_requests < 1) {
+                fprintf(stderr, "hvml-fpm: invalid number of requests: %s\n",
+                        optarg);
+                return -1;
+            }
+            break;
+        case 't': nr_threads = strtol(optarg, &endptr, 10);
+            if (*endptr || endptr == optarg || nr_threads < 1) {
+                fprintf(stderr, "hvml-fpm: invalid number of threads: %s\n",
+                        optarg);
+                return -1;
+            }
+            break;
+        case 'm': page_cache_size = parse_size(optarg, PAGE_CACHE_MAX_SIZE);
+            if (page_cache_size == 0) {
+                fprintf(stderr, "hvml-fpm: invalid page cache size: %s\n",
+                        optarg);
+                return -1;
+            }
+            break;
         case 'd': fcgi_dir = optarg; break;
         case 'a': addr = optarg;/* ip addr */ break;
         case 'p': port = strtol(optarg, &endptr, 10);/* port */
@@ -806,8 +919,25 @@ int main(int argc, char **argv)
 
     int rc;
     openlog("hvml-fpm", LOG_PID, LOG_USER);
+
+    /* before forking, so that all workers share the page cache */
+    if (page_ttls && page_cache_init(page_cache_size)) {
+        syslog(LOG_ERR, "Failed to create the page cache of %zu bytes\n",
+                page_cache_size);
+        rc = -1;
+        goto done;
+    }
+
+    if (fork_count > 0 && block_master_signals()) {
+        syslog(LOG_ERR, "Failed sigprocmask(): %s\n", strerror(errno));
+        rc = -1;
+        goto done;
+    }
+
     rc = fcgi_spawn_connection(hvml_app, init_script, script_query,
-            fcgi_fd, fork_count, pid_fd, max_executions);
+            body_limits, auto_etag, page_ttls, compression, progressive,
+            max_requests, nr_threads, fcgi_fd, fork_count, pid_fd,
+            max_executions);
     if (rc) {
         syslog(LOG_ERR, "Failed fcgi_spawn_connection(): %d\n", rc);
         goto done;
@@ -815,25 +945,31 @@ int main(int argc, char **argv)
 
     while (true) {
         int status;
-        pid_t pid = waitpid(-1, &status, 0);
-        if (pid == -1) {
+        bool respawn = false;
+
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        if (pid == 0) {
+            /* a SIGCHLD pending or coming goes on reaping */
+            if (sigwaitinfo(&master_signals, NULL) != SIG_REPLACE_WORKER)
+                continue;
+
+            /* the draining worker quits later with EXIT_REPLACED */
+            syslog(LOG_WARNING, "A draining worker asks for a new one\n");
+            respawn = true;
+        }
+        else if (pid == -1) {
+            if (errno == EINTR)
+                continue;
             syslog(LOG_ERR, "Failed waitpid(): %s\n", strerror(errno));
             break;
         }
-
-        if (WIFEXITED(status)) {
+        else if (WIFEXITED(status)) {
             int exit_code = WEXITSTATUS(status);
             syslog(LOG_ERR, "Child (%d) exited with: %d\n", pid, exit_code);
 
-            if (exit_code != EXIT_FAILURE) {
-                // fork a new child
-                rc = fcgi_spawn_connection(hvml_app, init_script, script_query,
-                        fcgi_fd, 1, pid_fd, max_executions);
-                if (rc) {
-                    syslog(LOG_ERR, "Failed fcgi_spawn_connection(): %d\n", rc);
-                    break;
-                }
-            }
+            /* already replaced when it began to drain */
+            respawn = (exit_code != EXIT_FAILURE &&
+                    exit_code != EXIT_REPLACED);
         }
         else if (WIFSIGNALED(status)) {
             syslog(LOG_ERR, "Child (%d) signaled : %d\n",
@@ -843,6 +979,18 @@ int main(int argc, char **argv)
             syslog(LOG_ERR, "Child (%d) died somehow: exit status = %d\n",
                     pid, status);
         }
+
+        if (respawn) {
+            // fork a new child
+            rc = fcgi_spawn_connection(hvml_app, init_script, script_query,
+                    body_limits, auto_etag, page_ttls, compression,
+                    progressive, max_requests, nr_threads, fcgi_fd, 1,
+                    pid_fd, max_executions);
+            if (rc) {
+                syslog(LOG_ERR, "Failed fcgi_spawn_connection(): %d\n", rc);
+                break;
+            }
+        }
     };
 
 done:
@@ -17,6 +17,7 @@
 #include <math.h>
 #include <memory.h>     /* for memchr() */
 #include <stdarg.h>
+#include <stddef.h>     /* for offsetof() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -172,6 +173,46 @@ int FCGX_GetStr(char *str, int n, FCGX_Stream *stream)
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_SkipStr --
+ *
+ *      Skips up to n consecutive bytes of the input stream, without
+ *      copying them anywhere.
+ *
+ * Results:
+ *      Number of bytes skipped.  If result is smaller than n,
+ *      the end of input has been reached.
+ *
+ *----------------------------------------------------------------------
+ */
+int FCGX_SkipStr(int n, FCGX_Stream *stream)
+{
+    int m, bytesSkipped;
+
+    if (stream->isClosed || ! stream->isReader || n <= 0) {
+        return 0;
+    }
+    bytesSkipped = 0;
+    for (;;) {
+        if(stream->rdNext != stream->stop) {
+            m = min(n - bytesSkipped, stream->stop - stream->rdNext);
+            bytesSkipped += m;
+            stream->rdNext += m;
+            if(bytesSkipped == n)
+                return bytesSkipped;
+        }
+        if(stream->isClosed || !stream->isReader)
+            return bytesSkipped;
+        stream->fillBuffProc(stream);
+        if (stream->isClosed)
+            return bytesSkipped;
+
+        stream->stopUnget = stream->rdNext;
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -284,6 +325,8 @@ int FCGX_PutChar(int c, FCGX_Stream *stream)
     return EOF;
 }
 
+static int PutStrDirect(FCGX_Stream *stream, const char *str, int n);
+
 /*
  *----------------------------------------------------------------------
  *
@@ -311,6 +354,14 @@ int FCGX_PutStr(const char *str, int n, FCGX_Stream *stream)
         stream->wrNext += n;
         return n;
     }
+    /*
+     * Content too large for the buffer is written from where it is
+     */
+    if(!stream->isReader && !stream->isClosed) {
+        bytesMoved = PutStrDirect(stream, str, n);
+        if(bytesMoved != 0)
+            return bytesMoved;
+    }
     /*
      * General case: stream is closed or buffer empty procedure
      * needs to be called
@@ -1015,6 +1066,54 @@ void FCGX_ClearError(FCGX_Stream *stream) {
  *======================================================================
  */
 
+/*
+ * The parameters of a request live in an arena owned by the Params
+ * structure.  Each entry holds the lengths of the name and the value,
+ * followed by the usual "name=value" environment string, so vec can
+ * still be handed out as environ while the lengths are known without
+ * calling strlen().  A null-terminated copy of the name follows the
+ * environment string, so that callers enumerating the parameters get
+ * both the name and the value as C strings without copying them.
+ * The arena is reset, not freed, between requests.
+ */
+typedef struct ParamEntry {
+    unsigned int nameLen;
+    unsigned int valueLen;
+    unsigned int hash;        /* hash of the name */
+    char nameValue[4];        /* name=value\0name\0, of variable size */
+} ParamEntry;
+
+#define PARAM_ENTRY_HDR_LEN         (offsetof(ParamEntry, nameValue))
+#define PARAM_ENTRY_SIZE(nLen, vLen) \
+    ((PARAM_ENTRY_HDR_LEN + 2 * (size_t)(nLen) + (size_t)(vLen) + 3 + 7) \
+        & ~(size_t)7)
+#define PARAM_ENTRY(nameValue) \
+    ((ParamEntry *)(void *)((char *)(nameValue) - PARAM_ENTRY_HDR_LEN))
+#define PARAM_ENTRY_NAME(entry) \
+    ((entry)->nameValue + (entry)->nameLen + (entry)->valueLen + 2)
+
+/*
+ * Default size of an arena block; big enough for the 30-40 parameters
+ * a typical Web server sends.
+ */
+#define PARAMS_ARENA_SIZE 4096
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;  /* older block */
+    size_t size;              /* bytes data can hold */
+    size_t used;              /* bytes handed out */
+    /* followed by the data, aligned to 8 bytes */
+} ArenaBlock;
+
+#define ARENA_BLOCK_HDR_LEN     ((sizeof(ArenaBlock) + 7) & ~(size_t)7)
+#define ARENA_BLOCK_DATA(block) ((unsigned char *)(block) + ARENA_BLOCK_HDR_LEN)
+
+/*
+ * Initial number of slots of the hash index; the index is kept at
+ * most half full.
+ */
+#define PARAMS_INDEX_SIZE 128
+
 /*
  * A vector of pointers representing the parameters received
  * by a FastCGI application server, with the vector's length
@@ -1025,6 +1124,11 @@ typedef struct Params {
     FCGX_ParamArray vec;    /* vector of strings */
     int length;                    /* number of string vec can hold */
     char **cur;                    /* current item in vec; *cur == NULL */
+    ArenaBlock *arena;             /* block being filled; NULL if none */
+    size_t arenaSize;              /* bytes all blocks can hold */
+    ParamEntry **index;            /* open-addressing hash index */
+    int indexSize;                 /* slots in index; a power of 2 */
+    int indexUsed;                 /* occupied slots in index */
 } Params;
 typedef Params *ParamsPtr;
 
@@ -1048,9 +1152,114 @@ static ParamsPtr NewParams(int length)
     result->length = length;
     result->cur = result->vec;
     *result->cur = NULL;
+    result->arena = NULL;
+    result->arenaSize = 0;
+    result->indexSize = PARAMS_INDEX_SIZE;
+    result->indexUsed = 0;
+    result->index = (ParamEntry **)calloc(result->indexSize,
+            sizeof(ParamEntry *));
+    ASSERT(result->index != NULL);
     return result;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewArenaBlock --
+ *
+ *        Allocates an arena block able to hold at least size bytes
+ *        and makes it the current block of the Params structure.
+ *
+ *----------------------------------------------------------------------
+ */
+static ArenaBlock *NewArenaBlock(ParamsPtr paramsPtr, size_t size)
+{
+    ArenaBlock *block;
+
+    size = max(size, PARAMS_ARENA_SIZE);
+    block = (ArenaBlock *)Malloc(ARENA_BLOCK_HDR_LEN + size);
+    block->next = paramsPtr->arena;
+    block->size = size;
+    block->used = 0;
+    paramsPtr->arena = block;
+    paramsPtr->arenaSize += size;
+    return block;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NewParamEntry --
+ *
+ *        Carves an entry for a name/value pair of the given lengths
+ *        out of the arena.  The content of the entry is left to the
+ *        caller, except for the lengths.
+ *
+ *----------------------------------------------------------------------
+ */
+static ParamEntry *NewParamEntry(ParamsPtr paramsPtr,
+        unsigned int nameLen, unsigned int valueLen)
+{
+    ArenaBlock *block = paramsPtr->arena;
+    size_t size = PARAM_ENTRY_SIZE(nameLen, valueLen);
+    ParamEntry *entry;
+
+    if (block == NULL || block->size - block->used < size) {
+        block = NewArenaBlock(paramsPtr, size);
+    }
+
+    entry = (ParamEntry *)(void *)(ARENA_BLOCK_DATA(block) + block->used);
+    block->used += size;
+    entry->nameLen = nameLen;
+    entry->valueLen = valueLen;
+    return entry;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ResetParams --
+ *
+ *        Empties a Params structure so it can be reused for the next
+ *        request.  If the parameters of the last request did not fit
+ *        in one arena block, the blocks are replaced by a single block
+ *        of the same total size, so that the next request of the
+ *        same shape needs no allocation at all.
+ *
+ * Side effects:
+ *      env becomes invalid.
+ *
+ *----------------------------------------------------------------------
+ */
+static void ResetParams(ParamsPtr paramsPtr)
+{
+    ArenaBlock *block = paramsPtr->arena;
+
+    if (block != NULL && block->next != NULL) {
+        size_t size = paramsPtr->arenaSize;
+        while (block != NULL) {
+            ArenaBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+        paramsPtr->arena = NULL;
+        paramsPtr->arenaSize = 0;
+        NewArenaBlock(paramsPtr, size);
+    }
+    else if (block != NULL) {
+        block->used = 0;
+    }
+
+    if (paramsPtr->indexUsed > 0) {
+        memset(paramsPtr->index, 0,
+                paramsPtr->indexSize * sizeof(ParamEntry *));
+        paramsPtr->indexUsed = 0;
+    }
+
+    paramsPtr->cur = paramsPtr->vec;
+    *paramsPtr->cur = NULL;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1066,24 +1275,121 @@ static ParamsPtr NewParams(int length)
 static void FreeParams(ParamsPtr *paramsPtrPtr)
 {
     ParamsPtr paramsPtr = *paramsPtrPtr;
-    char **p;
+    ArenaBlock *block;
     if(paramsPtr == NULL) {
         return;
     }
-    for (p = paramsPtr->vec; p < paramsPtr->cur; p++) {
-        free(*p);
+    block = paramsPtr->arena;
+    while (block != NULL) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
     }
+    free(paramsPtr->index);
     free(paramsPtr->vec);
     free(paramsPtr);
     *paramsPtrPtr = NULL;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * HashName --
+ *
+ *        Returns the 32-bit FNV-1a hash of a parameter name.
+ *
+ *----------------------------------------------------------------------
+ */
+static unsigned int HashName(const char *name, int len)
+{
+    unsigned int hash = 2166136261U;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FindParam --
+ *
+ *        Returns the slot of the hash index holding the entry for
+ *        the given name, or the empty slot where it would go.
+ *
+ *----------------------------------------------------------------------
+ */
+static ParamEntry **FindParam(ParamsPtr paramsPtr,
+        const char *name, unsigned int nameLen, unsigned int hash)
+{
+    unsigned int mask = paramsPtr->indexSize - 1;
+    unsigned int i = hash & mask;
+    ParamEntry *entry;
+
+    while ((entry = paramsPtr->index[i]) != NULL) {
+        if (entry->hash == hash && entry->nameLen == nameLen
+                && memcmp(entry->nameValue, name, nameLen) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return paramsPtr->index + i;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * IndexParam --
+ *
+ *        Adds an entry to the hash index, doubling the index first if
+ *        it would become more than half full.  Like getenv(), lookups
+ *        find the first of several parameters having the same name.
+ *
+ *----------------------------------------------------------------------
+ */
+static void IndexParam(ParamsPtr paramsPtr, ParamEntry *entry)
+{
+    ParamEntry **slot;
+
+    entry->hash = HashName(entry->nameValue, entry->nameLen);
+
+    if ((paramsPtr->indexUsed + 1) * 2 > paramsPtr->indexSize) {
+        ParamEntry **oldIndex = paramsPtr->index;
+        int oldSize = paramsPtr->indexSize;
+        int i;
+
+        paramsPtr->indexSize *= 2;
+        paramsPtr->index = (ParamEntry **)calloc(paramsPtr->indexSize,
+                sizeof(ParamEntry *));
+        ASSERT(paramsPtr->index != NULL);
+        for (i = 0; i < oldSize; i++) {
+            if (oldIndex[i] != NULL) {
+                *FindParam(paramsPtr, oldIndex[i]->nameValue,
+                        oldIndex[i]->nameLen, oldIndex[i]->hash) = oldIndex[i];
+            }
+        }
+        free(oldIndex);
+    }
+
+    slot = FindParam(paramsPtr, entry->nameValue, entry->nameLen, entry->hash);
+    if (*slot == NULL) {
+        *slot = entry;
+        paramsPtr->indexUsed++;
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
  * PutParam --
  *
- *        Add a name/value pair to a Params structure.
+ *        Add a name/value pair to a Params structure.  nameValue
+ *        must be the string of an entry returned by NewParamEntry,
+ *        already holding name=value\0; the copy of the name is made
+ *        here.
  *
  * Results:
  *      None.
@@ -1095,8 +1401,13 @@ static void FreeParams(ParamsPtr *paramsPtrPtr)
  */
 static void PutParam(ParamsPtr paramsPtr, char *nameValue)
 {
+    ParamEntry *entry = PARAM_ENTRY(nameValue);
+    char *name = PARAM_ENTRY_NAME(entry);
     int size;
 
+    memcpy(name, nameValue, entry->nameLen);
+    name[entry->nameLen] = '\0';
+    IndexParam(paramsPtr, entry);
     *paramsPtr->cur++ = nameValue;
     size = paramsPtr->cur - paramsPtr->vec;
     if(size >= paramsPtr->length) {
@@ -1107,6 +1418,30 @@ static void PutParam(ParamsPtr paramsPtr, char *nameValue)
     *paramsPtr->cur = NULL;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * PutParamString --
+ *
+ *        Copies a name/value pair into the arena and adds it to
+ *        a Params structure.
+ *
+ *----------------------------------------------------------------------
+ */
+static void PutParamString(ParamsPtr paramsPtr,
+        const char *name, const char *value)
+{
+    unsigned int nameLen = strlen(name);
+    unsigned int valueLen = strlen(value);
+    ParamEntry *entry = NewParamEntry(paramsPtr, nameLen, valueLen);
+
+    memcpy(entry->nameValue, name, nameLen);
+    entry->nameValue[nameLen] = '=';
+    memcpy(entry->nameValue + nameLen + 1, value, valueLen);
+    entry->nameValue[nameLen + valueLen + 1] = '\0';
+    PutParam(paramsPtr, entry->nameValue);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1137,6 +1472,98 @@ char *FCGX_GetParam(const char *name, FCGX_ParamArray envp)
     return NULL;
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_InitParamKey --
+ *
+ *        Fills in key for the parameter name.
+ *
+ *----------------------------------------------------------------------
+ */
+void FCGX_InitParamKey(FCGX_ParamKey *key, const char *name)
+{
+    key->name = name;
+    key->len = strlen(name);
+    key->hash = HashName(name, key->len);
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_LookupParam -- obtain value of FCGI parameter by key
+ *
+ *
+ * Results:
+ *        Value bound to the name of key, NULL if the name is not
+ *      present in the parameters of request.  Caller must not mutate
+ *      the result or retain it past the end of this request.
+ *
+ *----------------------------------------------------------------------
+ */
+const char *FCGX_LookupParam(const FCGX_ParamKey *key,
+        FCGX_Request *request, int *valueLen)
+{
+    ParamEntry *entry;
+
+    if (key == NULL || request == NULL || request->paramsPtr == NULL)
+        return NULL;
+
+    entry = *FindParam(request->paramsPtr, key->name, key->len, key->hash);
+    if (entry == NULL)
+        return NULL;
+
+    if (valueLen)
+        *valueLen = entry->valueLen;
+    return entry->nameValue + entry->nameLen + 1;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_GetParamCount --
+ *
+ *        Returns the number of parameters of request.
+ *
+ *----------------------------------------------------------------------
+ */
+int FCGX_GetParamCount(FCGX_Request *request)
+{
+    if (request == NULL || request->paramsPtr == NULL)
+        return 0;
+
+    return request->paramsPtr->cur - request->paramsPtr->vec;
+}
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_GetParamAt -- obtain the i-th FCGI parameter of a request
+ *
+ *
+ * Results:
+ *        0 and param filled in if i is a valid index, -1 otherwise.
+ *      The strings param refers to belong to the request; caller
+ *      must not mutate them or retain them past the end of this
+ *      request.
+ *
+ *----------------------------------------------------------------------
+ */
+int FCGX_GetParamAt(FCGX_Request *request, int i, FCGX_Param *param)
+{
+    ParamEntry *entry;
+
+    if (i < 0 || i >= FCGX_GetParamCount(request))
+        return -1;
+
+    entry = PARAM_ENTRY(request->paramsPtr->vec[i]);
+    param->name = PARAM_ENTRY_NAME(entry);
+    param->nameLen = entry->nameLen;
+    param->value = entry->nameValue + entry->nameLen + 1;
+    param->valueLen = entry->valueLen;
+    return 0;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1159,6 +1586,7 @@ static int ReadParams(Params *paramsPtr, FCGX_Stream *stream)
 {
     int nameLen, valueLen;
     unsigned char lenBuff[3];
+    ParamEntry *entry;
     char *nameValue;
 
     while((nameLen = FCGX_GetChar(stream)) != EOF) {
@@ -1188,19 +1616,20 @@ static int ReadParams(Params *paramsPtr, FCGX_Stream *stream)
         }
         /*
          * nameLen and valueLen are now valid; read the name and value
-         * from stream and construct a standard environment entry.
+         * from stream straight into an arena entry, constructing
+         * a standard environment entry.  On error the space taken
+         * from the arena is reclaimed by the next ResetParams().
          */
-        nameValue = (char *)Malloc(nameLen + valueLen + 2);
+        entry = NewParamEntry(paramsPtr, nameLen, valueLen);
+        nameValue = entry->nameValue;
         if(FCGX_GetStr(nameValue, nameLen, stream) != nameLen) {
             SetError(stream, FCGX_PARAMS_ERROR);
-            free(nameValue);
             return -1;
         }
         *(nameValue + nameLen) = '=';
         if(FCGX_GetStr(nameValue + nameLen + 1, valueLen, stream)
                 != valueLen) {
             SetError(stream, FCGX_PARAMS_ERROR);
-            free(nameValue);
             return -1;
         }
         *(nameValue + nameLen + valueLen + 1) = '\0';
@@ -1347,20 +1776,32 @@ int FCGX_GetFD(FCGX_Stream *stream)
     return data->reqDataPtr->ipcFd;
 }
 
+/*
+ * Largest trailer WriteCloseRecords can produce: an empty stream
+ * record plus an FCGI_END_REQUEST record.
+ */
+#define CLOSE_RECORDS_LEN (sizeof(FCGI_Header) + sizeof(FCGI_EndRequestRecord))
+
 /*
  *----------------------------------------------------------------------
  *
  * WriteCloseRecords --
  *
- *      Writes an EOF record for the stream content if necessary.
- *      If this is the last writer to close, writes an FCGI_END_REQUEST
- *      record.
+ *      Builds an EOF record for the stream content if necessary.
+ *      If this is the last writer to close, appends an FCGI_END_REQUEST
+ *      record.  The records are stored in recs (which must hold
+ *      CLOSE_RECORDS_LEN bytes) rather than in the stream buffer, so
+ *      the caller can send them together with the buffered content.
+ *
+ * Results:
+ *      Number of bytes stored in recs.
  *
  *----------------------------------------------------------------------
  */
-static void WriteCloseRecords(struct FCGX_Stream *stream)
+static int WriteCloseRecords(struct FCGX_Stream *stream, unsigned char *recs)
 {
     FCGX_Stream_Data *data = (FCGX_Stream_Data *)stream->data;
+    int len = 0;
     /*
      * Enter rawWrite mode so final records won't be encapsulated as
      * stream data.
@@ -1374,7 +1815,8 @@ static void WriteCloseRecords(struct FCGX_Stream *stream)
             && !data->isAnythingWritten)) {
         FCGI_Header header;
         header = MakeHeader(data->type, data->reqDataPtr->requestId, 0, 0);
-        FCGX_PutStr((char *) &header, sizeof(header), stream);
+        memcpy(recs + len, &header, sizeof(header));
+        len += sizeof(header);
     };
     /*
      * Generate FCGI_END_REQUEST record if needed.
@@ -1386,10 +1828,11 @@ static void WriteCloseRecords(struct FCGX_Stream *stream)
                 sizeof(endRequestRecord.body), 0);
         endRequestRecord.body = MakeEndRequestBody(
                 data->reqDataPtr->appStatus, FCGI_REQUEST_COMPLETE);
-        FCGX_PutStr((char *) &endRequestRecord,
-                sizeof(endRequestRecord), stream);
+        memcpy(recs + len, &endRequestRecord, sizeof(endRequestRecord));
+        len += sizeof(endRequestRecord);
     }
     data->reqDataPtr->nWriters--;
+    return len;
 }
 
 
@@ -1408,6 +1851,31 @@ static int write_it_all(int fd, char *buf, int len)
     return len;
 }
 
+/*
+ * Like write_it_all, but for two buffers.  Both go out with one
+ * gathering write unless the kernel takes only part of them.
+ */
+static int write_it_all2(int fd, char *buf1, int len1, char *buf2, int len2)
+{
+    int wrote;
+
+    if (len2 == 0)
+        return write_it_all(fd, buf1, len1);
+
+    while (len1) {
+        wrote = OS_WriteV(fd, buf1, len1, buf2, len2);
+        if (wrote < 0)
+            return wrote;
+        if (wrote >= len1) {
+            wrote -= len1;
+            return write_it_all(fd, buf2 + wrote, len2 - wrote);
+        }
+        len1 -= wrote;
+        buf1 += wrote;
+    }
+    return write_it_all(fd, buf2, len2);
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -1415,13 +1883,16 @@ static int write_it_all(int fd, char *buf, int len)
  *
  *      Encapsulates any buffered stream content in a FastCGI
  *      record.  Writes the data, making the buffer empty.
+ *      When closing, the final content, the EOF record and the
+ *      FCGI_END_REQUEST record are written with a single syscall.
  *
  *----------------------------------------------------------------------
  */
 static void EmptyBuffProc(struct FCGX_Stream *stream, int doClose)
 {
     FCGX_Stream_Data *data = (FCGX_Stream_Data *)stream->data;
-    int cLen, eLen;
+    unsigned char closeRecs[CLOSE_RECORDS_LEN];
+    int cLen, eLen, closeLen = 0;
     /*
      * If the buffer contains stream data, fill in the header.
      * Pad the record to a multiple of 8 bytes in length.  Padding
@@ -1446,11 +1917,13 @@ static void EmptyBuffProc(struct FCGX_Stream *stream, int doClose)
         }
     }
     if(doClose) {
-        WriteCloseRecords(stream);
+        closeLen = WriteCloseRecords(stream, closeRecs);
     };
-    if (stream->wrNext != data->buff) {
+    if (stream->wrNext != data->buff || closeLen > 0) {
         data->isAnythingWritten = TRUE;
-        if (write_it_all(data->reqDataPtr->ipcFd, (char *)data->buff, stream->wrNext - data->buff) < 0) {
+        if (write_it_all2(data->reqDataPtr->ipcFd, (char *)data->buff,
+                    stream->wrNext - data->buff,
+                    (char *)closeRecs, closeLen) < 0) {
             SetError(stream, OS_Errno);
             return;
         }
@@ -1464,6 +1937,53 @@ static void EmptyBuffProc(struct FCGX_Stream *stream, int doClose)
     }
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * PutStrDirect --
+ *
+ *      Writes content not smaller than the buffer of the stream
+ *      without copying it into the buffer: the buffered content
+ *      goes out first, then each record header is written together
+ *      with the content following it in one gathering write.
+ *
+ * Results:
+ *      Number of bytes written (n), 0 if the stream cannot be written
+ *      this way or n is too small, or EOF (-1) if an error occurred.
+ *
+ *----------------------------------------------------------------------
+ */
+static int PutStrDirect(FCGX_Stream *stream, const char *str, int n)
+{
+    FCGX_Stream_Data *data = (FCGX_Stream_Data *)stream->data;
+    int bytesMoved = 0;
+
+    if(stream->emptyBuffProc != EmptyBuffProc || data->rawWrite
+            || n < data->bufflen) {
+        return 0;
+    }
+
+    EmptyBuffProc(stream, FALSE);
+    if(stream->isClosed) {
+        return EOF;
+    }
+
+    while(bytesMoved < n) {
+        FCGI_Header header;
+        int len = min(n - bytesMoved, FCGI_MAX_LENGTH & ~7);
+
+        header = MakeHeader(data->type, data->reqDataPtr->requestId, len, 0);
+        if(write_it_all2(data->reqDataPtr->ipcFd, (char *)&header,
+                    sizeof(header), (char *)str + bytesMoved, len) < 0) {
+            SetError(stream, OS_Errno);
+            return EOF;
+        }
+        data->isAnythingWritten = TRUE;
+        bytesMoved += len;
+    }
+    return bytesMoved;
+}
+
 /*
  * Return codes for Process* functions
  */
@@ -1503,11 +2023,7 @@ static int ProcessManagementRecord(int type, FCGX_Stream *stream)
             return FCGX_PROTOCOL_ERROR;
         }
         for (pPtr = paramsPtr->vec; pPtr < paramsPtr->cur; pPtr++) {
-            name = *pPtr;
-            char *tmpPtr = strchr(name, '=');
-            if(tmpPtr != NULL) {
-                *tmpPtr = '\0';
-            }
+            name = PARAM_ENTRY_NAME(PARAM_ENTRY(*pPtr));
             if(strcmp(name, FCGI_MAX_CONNS) == 0) {
                 value = '1';
             } else if(strcmp(name, FCGI_MAX_REQS) == 0) {
@@ -2020,6 +2536,40 @@ void FCGX_Finish(void)
     FCGX_Finish_r(&the_request);
 }
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * ReleaseRequest --
+ *
+ *      Frees the streams of the request and, if close is true, closes
+ *      its IPC FD.  The parameters are freed if freeParams is true;
+ *      otherwise only their arena is reset so it can be reused by the
+ *      next request accepted with the same FCGX_Request.
+ *
+ *----------------------------------------------------------------------
+ */
+static void ReleaseRequest(FCGX_Request *request, int close, int freeParams)
+{
+    if (request == NULL)
+        return;
+
+    FCGX_FreeStream(&request->in);
+    FCGX_FreeStream(&request->out);
+    FCGX_FreeStream(&request->err);
+    if (freeParams) {
+        FreeParams(&request->paramsPtr);
+    }
+    else if (request->paramsPtr) {
+        ResetParams(request->paramsPtr);
+    }
+
+    if (close) {
+        OS_IpcClose(request->ipcFd, ! request->detached);
+        request->ipcFd = -1;
+        request->detached = 0;
+    }
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -2057,24 +2607,33 @@ void FCGX_Finish_r(FCGX_Request *reqDataPtr)
         close |= FCGX_GetError(reqDataPtr->in);
     }
 
-    FCGX_Free(reqDataPtr, close);
+    ReleaseRequest(reqDataPtr, close, FALSE);
 }
 
-void FCGX_Free(FCGX_Request * request, int close)
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_EndResponse_r --
+ *
+ *      Ends the response of the request without releasing it; the
+ *      streams are closed again (which does nothing) and the request
+ *      is released by the next FCGX_Finish_r or FCGX_Accept_r.
+ *
+ *----------------------------------------------------------------------
+ */
+void FCGX_EndResponse_r(FCGX_Request *reqDataPtr)
 {
-    if (request == NULL) 
+    if (reqDataPtr == NULL || reqDataPtr->in == NULL) {
         return;
+    }
 
-    FCGX_FreeStream(&request->in);
-    FCGX_FreeStream(&request->out);
-    FCGX_FreeStream(&request->err);
-    FreeParams(&request->paramsPtr);
+    FCGX_FClose(reqDataPtr->err);
+    FCGX_FClose(reqDataPtr->out);
+}
 
-    if (close) {
-        OS_IpcClose(request->ipcFd, ! request->detached);
-        request->ipcFd = -1;
-        request->detached = 0;
-    }
+void FCGX_Free(FCGX_Request * request, int close)
+{
+    ReleaseRequest(request, close, TRUE);
 }
 
 int FCGX_OpenSocket(const char *path, int backlog)
@@ -2254,19 +2813,21 @@ int FCGX_Accept_r(FCGX_Request *reqDataPtr)
             const char *roleStr;
             switch(reqDataPtr->role) {
                 case FCGI_RESPONDER:
-                    roleStr = "FCGI_ROLE=RESPONDER";
+                    roleStr = "RESPONDER";
                     break;
                 case FCGI_AUTHORIZER:
-                    roleStr = "FCGI_ROLE=AUTHORIZER";
+                    roleStr = "AUTHORIZER";
                     break;
                 case FCGI_FILTER:
-                    roleStr = "FCGI_ROLE=FILTER";
+                    roleStr = "FILTER";
                     break;
                 default:
                     goto TryAgain;
             }
-            reqDataPtr->paramsPtr = NewParams(30);
-            PutParam(reqDataPtr->paramsPtr, StringCopy(roleStr));
+            if (reqDataPtr->paramsPtr == NULL) {
+                reqDataPtr->paramsPtr = NewParams(64);
+            }
+            PutParamString(reqDataPtr->paramsPtr, "FCGI_ROLE", roleStr);
         }
         SetReaderType(reqDataPtr->in, FCGI_PARAMS);
         if(ReadParams(reqDataPtr->paramsPtr, reqDataPtr->in) >= 0) {
@@ -2281,7 +2842,7 @@ int FCGX_Accept_r(FCGX_Request *reqDataPtr)
          * Close the connection and try again.
          */
 TryAgain:
-        FCGX_Free(reqDataPtr, 1);
+        ReleaseRequest(reqDataPtr, 1, FALSE);
 
     } /* for (;;) */
     /*
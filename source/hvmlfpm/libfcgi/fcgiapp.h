@@ -228,6 +228,25 @@ DLLAPI int FCGX_Accept_r(FCGX_Request *request);
  */
 DLLAPI void FCGX_Finish_r(FCGX_Request *request);
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_EndResponse_r --
+ *
+ *      Ends the response of the request (multi-thread safe).
+ *
+ * Side effects:
+ *
+ *      Flushes the output and sends the end of the request to the
+ *      HTTP server, so that the client gets the whole response.
+ *      Unlike FCGX_Finish_r, keeps the parameters of the request,
+ *      which stay valid until the request is finished.  Nothing can
+ *      be written to the request afterwards.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI void FCGX_EndResponse_r(FCGX_Request *request);
+
 /*
  *----------------------------------------------------------------------
  *
@@ -362,6 +381,90 @@ DLLAPI void FCGX_SetExitStatus(int status, FCGX_Stream *stream);
  *----------------------------------------------------------------------
  */
 DLLAPI char *FCGX_GetParam(const char *name, FCGX_ParamArray envp);
+
+/*
+ * FCGX_ParamKey -- A parameter name with its precomputed hash.
+ *
+ * Initialize it once with FCGX_InitParamKey() and use it for
+ * any number of FCGX_LookupParam() calls.
+ */
+typedef struct FCGX_ParamKey {
+    const char *name;
+    int len;
+    unsigned int hash;
+} FCGX_ParamKey;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_InitParamKey --
+ *
+ *      Fills in key for the parameter name.  The key refers to name,
+ *      which must stay valid as long as the key is used.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI void FCGX_InitParamKey(FCGX_ParamKey *key, const char *name);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_LookupParam -- obtain value of FCGI parameter by key
+ *
+ *      Looks the parameter up in the hash index built while the
+ *      parameters of the request were read.
+ *
+ * Results:
+ *	Value bound to the name of key, NULL if the name is not present
+ *      in the parameters of request.  If valueLen is not NULL, the
+ *      length of the value is stored there.  Caller must not mutate
+ *      the result or retain it past the end of this request.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI const char *FCGX_LookupParam(const FCGX_ParamKey *key,
+        FCGX_Request *request, int *valueLen);
+
+/*
+ * FCGX_Param -- A parameter of a request, as returned by
+ * FCGX_GetParamAt().  Both name and value are null-terminated.
+ */
+typedef struct FCGX_Param {
+    const char *name;
+    int nameLen;
+    const char *value;
+    int valueLen;
+} FCGX_Param;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_GetParamCount --
+ *
+ *      Returns the number of parameters of request, in the order
+ *      the Web server sent them.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI int FCGX_GetParamCount(FCGX_Request *request);
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_GetParamAt -- obtain the i-th FCGI parameter of a request
+ *
+ *      Lets a caller enumerate the parameters without parsing the
+ *      name=value strings of envp.
+ *
+ * Results:
+ *	0 and param filled in if 0 <= i < FCGX_GetParamCount(request),
+ *      -1 otherwise.  Caller must not mutate the strings param
+ *      refers to or retain them past the end of this request.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI int FCGX_GetParamAt(FCGX_Request *request, int i, FCGX_Param *param);
+
 
 /*
  *======================================================================
@@ -416,6 +519,22 @@ DLLAPI int FCGX_UnGetChar(int c, FCGX_Stream *stream);
  */
 DLLAPI int FCGX_GetStr(char *str, int n, FCGX_Stream *stream);
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * FCGX_SkipStr --
+ *
+ *      Skips up to n consecutive bytes of the input stream; this is
+ *      FCGX_GetStr without the copy, useful to discard unwanted input.
+ *
+ * Results:
+ *	Number of bytes skipped.  If result is smaller than n,
+ *      the end of input has been reached.
+ *
+ *----------------------------------------------------------------------
+ */
+DLLAPI int FCGX_SkipStr(int n, FCGX_Stream *stream);
+
 /*
  *----------------------------------------------------------------------
  *
@@ -106,6 +106,8 @@ DLLAPI int OS_CreateLocalIpcFd(const char *bindPath, int backlog);
 DLLAPI int OS_FcgiConnect(char *bindPath);
 DLLAPI int OS_Read(int fd, char * buf, size_t len);
 DLLAPI int OS_Write(int fd, char * buf, size_t len);
+DLLAPI int OS_WriteV(int fd, char * buf1, size_t len1,
+                     char * buf2, size_t len2);
 DLLAPI int OS_SpawnChild(char *execPath, int listenFd);
 DLLAPI int OS_AsyncReadStdin(void *buf, int len, OS_AsyncProc procPtr,
                              ClientData clientData);
@@ -52,6 +52,8 @@
 #include <unistd.h>
 #endif
 
+#include <sys/uio.h>
+
 #include "fastcgi.h"
 #include "fcgimisc.h"
 #include "fcgios.h"
@@ -517,6 +519,37 @@ int OS_Write(int fd, char * buf, size_t len)
     return(write(fd, buf, len));
 }
 
+/*
+ *--------------------------------------------------------------
+ *
+ * OS_WriteV --
+ *
+ *    Writes two buffers with one gathering write, so that a
+ *    record trailer goes out in the same syscall (and usually
+ *    the same packet) as the data preceding it.
+ *
+ * Results:
+ *    Returns number of bytes written, 0, or -1 failure: errno
+ *      contains actual error.
+ *
+ * Side effects:
+ *    none.
+ *
+ *--------------------------------------------------------------
+ */
+int OS_WriteV(int fd, char * buf1, size_t len1, char * buf2, size_t len2)
+{
+    struct iovec iov[2];
+
+    if (shutdownNow) return -1;
+
+    iov[0].iov_base = buf1;
+    iov[0].iov_len = len1;
+    iov[1].iov_base = buf2;
+    iov[1].iov_len = len2;
+    return(writev(fd, iov, 2));
+}
+
 /*
  *----------------------------------------------------------------------
  *
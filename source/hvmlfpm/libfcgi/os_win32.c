@@ -1037,6 +1037,36 @@ int OS_Write(int fd, char * buf, size_t len)
     return ret;
 }
 
+/*
+ *--------------------------------------------------------------
+ *
+ * OS_WriteV --
+ *
+ *	Writes two buffers one after the other.  There is no gathering
+ *	write shared by all the handle types here, so this only saves
+ *	the caller from copying the buffers together.
+ *
+ * Results:
+ *	Returns number of bytes written, or -1 on failure.  A short
+ *	count means the second buffer was not (fully) written.
+ *
+ *--------------------------------------------------------------
+ */
+int OS_WriteV(int fd, char * buf1, size_t len1, char * buf2, size_t len2)
+{
+    int ret1, ret2;
+
+    ret1 = OS_Write(fd, buf1, len1);
+    if (ret1 < 0 || (size_t)ret1 < len1 || len2 == 0)
+        return ret1;
+
+    ret2 = OS_Write(fd, buf2, len2);
+    if (ret2 < 0)
+        return ret1 > 0 ? ret1 : ret2;
+
+    return ret1 + ret2;
+}
+
 /*
  *----------------------------------------------------------------------
  *
@@ -480,8 +480,9 @@ static multipart_parser_settings settings = {
 };
 
 int
-parse_content_as_multipart_form_data(size_t content_length,
-        const char *boundary, purc_variant_t *post, purc_variant_t *files)
+parse_content_as_multipart_form_data(purc_rwstream_t stm,
+        size_t content_length, const char *boundary,
+        purc_variant_t *post, purc_variant_t *files)
 {
     mpart_body_processor processor = { };
 
@@ -491,33 +492,35 @@ parse_content_as_multipart_form_data(size_t content_length,
     processor.post = purc_variant_make_object_0();
     processor.files = purc_variant_make_object_0();
 
+    int ret = (processor.post && processor.files) ? 0 : -1;
     size_t nr_bytes = 0;
-    do {
+    while (ret == 0) {
         char buf[256];
-        size_t n = fread(buf, 1, sizeof(buf), stdin);
+        ssize_t n = purc_rwstream_read(stm, buf, sizeof(buf));
+        if (n <= 0)
+            break;
 
         size_t consumed = multipart_parser_execute(processor.parser, buf, n);
         HFLOG_DEBUG("Consumed bytes by the parser: %u (got %u)\n",
                 (unsigned)consumed, (unsigned)n);
 
-        if (consumed < n) {
+        if (consumed < (size_t)n) {
             HFLOG_ERROR("Failed multipart_parser_execute().\n");
+            ret = -1;
             break;
         }
 
         nr_bytes += n;
-        if (n < sizeof(buf))
-            break;
-
-    } while (true);
+    }
 
     if (nr_bytes < content_length) {
         HFLOG_ERROR("Mismatched content length and content got.\n");
+        ret = -1;
     }
 
     *post = processor.post;
     *files = processor.files;
     mpart_body_processor_release(&processor);
-    return 0;
+    return ret;
 }
 
@@ -1,7 +1,7 @@
 #ifndef _mpart_body_processor_h
 #define _mpart_body_processor_h
 
-#include <purc/purc-variant.h>
+#include <purc/purc.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -10,9 +10,15 @@ extern "C" {
 purc_variant_t
 purc_make_object_from_http_header_value(const char *value);
 
+/*
+ * Parses the content of multipart/form-data read from stm, which ends at
+ * the end of the content.  Returns 0 on success, or -1 if the content is
+ * bad or short; *post and *files are set in both cases.
+ */
 int
-parse_content_as_multipart_form_data(size_t content_length,
-        const char *boundary, purc_variant_t *post, purc_variant_t *files);
+parse_content_as_multipart_form_data(purc_rwstream_t stm,
+        size_t content_length, const char *boundary,
+        purc_variant_t *post, purc_variant_t *files);
 
 #ifdef __cplusplus
 } /* extern "C" */
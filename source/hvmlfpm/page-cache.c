@@ -0,0 +1,720 @@
+/*
+ * @file page-cache.c
+ * @author Vincent Wei
+ * @date 2026/10/18
+ * @brief The implementation of the full-page output cache.
+ *
+ * Copyright (C) 2023 FMSoft <https://www.fmsoft.cn>
+ *
+ * This file is a part of hvml-fpm, which is an HVML FastCGI implementation.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "hvml-executor.h"
+#include "page-cache.h"
+
+/*
+ * The cache lives in a shared memory segment mapped before the workers
+ * are forked, so that all of them share the pages.  The segment is split
+ * into shards, each of which has its own lock, hash index, entries, and
+ * blocks.  A page is stored in a chain of fixed-size blocks, and evicted
+ * by the CLOCK algorithm when the shard runs out of blocks or entries.
+ *
+ * The worker missing a page takes a lease on the entry (made without
+ * page if need be) while making the page; meanwhile, the other workers
+ * get the expired page if it is in its grace period, or wait for the
+ * new one.
+ * Within the grace period of a page, the worker taking the lease also
+ * gets the expired page, and makes the new one after sending it.
+ */
+#define NR_SHARDS           16
+#define BLOCK_SIZE          4096
+#define NIL                 UINT32_MAX
+
+/* the seconds a worker has to make the page after taking the lease */
+#define FILL_LEASE          30
+
+#define ALIGN_UP(n)         (((n) + 63) & ~(size_t)63)
+
+struct page_cache_entry {
+    uint64_t hash;
+    time_t expires;
+
+    /* the end of the grace period, in which the expired page is served */
+    time_t stale_until;
+
+    /* the next one in the hash chain, or in the list of free entries */
+    uint32_t next;
+
+    uint32_t first_block;
+    uint32_t nr_blocks;
+    uint8_t used;
+    uint8_t referenced;
+
+    /* false for an entry made only to hold the lease */
+    uint8_t has_page;
+
+    /* the lease of the request making the page, and until when it is
+       trusted to; 0 if there is none */
+    uint64_t filler;
+    time_t fill_deadline;
+
+    /* the key, the ETag (with the null), the headers, then the body */
+    uint32_t key_len;
+    uint32_t etag_len;
+    size_t hdr_len;
+    size_t body_len;
+};
+
+struct page_cache_shard {
+    pthread_mutex_t lock;
+
+    uint32_t clock_hand;
+    uint32_t free_entries;
+    uint32_t free_blocks;
+    uint32_t nr_free_blocks;
+
+    /* the bytes of the pages kept */
+    size_t size;
+};
+
+struct page_cache {
+    size_t map_size;
+    size_t shard_size;
+
+    /* the numbers of the buckets, entries, and blocks of a shard */
+    uint32_t nr_buckets;
+    uint32_t nr_entries;
+    uint32_t nr_blocks;
+
+    /* the offsets of the arrays from the start of a shard */
+    size_t off_buckets;
+    size_t off_entries;
+    size_t off_next_block;
+    size_t off_blocks;
+};
+
+static struct page_cache *cache;
+
+/* the copy of the last hit, owned by this thread */
+static __thread char *hit_buf;
+static __thread size_t hit_buf_size;
+
+#define SHARD(i)            ((struct page_cache_shard *)((char *)cache + \
+            ALIGN_UP(sizeof(struct page_cache)) + cache->shard_size * (i)))
+#define BUCKETS(shard)      ((uint32_t *)((char *)(shard) + cache->off_buckets))
+#define ENTRIES(shard)      \
+    ((struct page_cache_entry *)((char *)(shard) + cache->off_entries))
+#define NEXT_BLOCK(shard)   \
+    ((uint32_t *)((char *)(shard) + cache->off_next_block))
+#define BLOCK(shard, i)     \
+    ((char *)(shard) + cache->off_blocks + (size_t)BLOCK_SIZE * (i))
+
+static time_t now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void reset_shard(struct page_cache_shard *shard)
+{
+    struct page_cache_entry *entries = ENTRIES(shard);
+    uint32_t *buckets = BUCKETS(shard);
+    uint32_t *next_block = NEXT_BLOCK(shard);
+
+    for (uint32_t i = 0; i < cache->nr_buckets; i++)
+        buckets[i] = NIL;
+
+    for (uint32_t i = 0; i < cache->nr_entries; i++) {
+        entries[i].used = 0;
+        entries[i].next = (i + 1 < cache->nr_entries) ? i + 1 : NIL;
+    }
+
+    for (uint32_t i = 0; i < cache->nr_blocks; i++)
+        next_block[i] = (i + 1 < cache->nr_blocks) ? i + 1 : NIL;
+
+    shard->clock_hand = 0;
+    shard->free_entries = 0;
+    shard->free_blocks = 0;
+    shard->nr_free_blocks = cache->nr_blocks;
+    shard->size = 0;
+}
+
+int page_cache_init(size_t max_size)
+{
+    if (cache)
+        return 0;
+
+    /* the numbers of the blocks and the entries fit in uint32_t */
+    if (max_size > PAGE_CACHE_MAX_SIZE)
+        max_size = PAGE_CACHE_MAX_SIZE;
+
+    uint32_t nr_blocks = max_size / BLOCK_SIZE / NR_SHARDS;
+    if (nr_blocks < 16)
+        nr_blocks = 16;
+
+    /* the pages take two blocks on average */
+    uint32_t nr_entries = nr_blocks / 2;
+    uint32_t nr_buckets = 1;
+    while (nr_buckets < nr_entries)
+        nr_buckets <<= 1;
+
+    struct page_cache layout = { 0 };
+    layout.nr_buckets = nr_buckets;
+    layout.nr_entries = nr_entries;
+    layout.nr_blocks = nr_blocks;
+    layout.off_buckets = ALIGN_UP(sizeof(struct page_cache_shard));
+    layout.off_entries = layout.off_buckets +
+        ALIGN_UP(sizeof(uint32_t) * nr_buckets);
+    layout.off_next_block = layout.off_entries +
+        ALIGN_UP(sizeof(struct page_cache_entry) * nr_entries);
+    layout.off_blocks = ALIGN_UP(layout.off_next_block +
+            sizeof(uint32_t) * nr_blocks);
+    layout.shard_size = layout.off_blocks + (size_t)BLOCK_SIZE * nr_blocks;
+    layout.map_size = ALIGN_UP(sizeof(struct page_cache)) +
+        layout.shard_size * NR_SHARDS;
+
+    void *map = mmap(NULL, layout.map_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        HFLOG_ERROR("Failed to map %zu bytes for the page cache: %s\n",
+                layout.map_size, strerror(errno));
+        return -1;
+    }
+
+    cache = map;
+    *cache = layout;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+
+    for (int i = 0; i < NR_SHARDS; i++) {
+        struct page_cache_shard *shard = SHARD(i);
+        pthread_mutex_init(&shard->lock, &attr);
+        reset_shard(shard);
+    }
+
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+void page_cache_cleanup(void)
+{
+    if (cache) {
+        munmap(cache, cache->map_size);
+        cache = NULL;
+    }
+
+    page_cache_thread_cleanup();
+}
+
+void page_cache_thread_cleanup(void)
+{
+    free(hit_buf);
+    hit_buf = NULL;
+    hit_buf_size = 0;
+}
+
+/* the requests which took a lease in this thread */
+static __thread uint32_t nr_leases;
+
+/*
+ * The thread, unique among the workers and their threads, in the high
+ * half, and the count of the requests of the thread in the low one; a
+ * thread runs several requests at a time when multiplexed.
+ */
+uint64_t page_cache_new_lease(void)
+{
+#ifdef __linux__
+    uint64_t id = (uint32_t)syscall(SYS_gettid);
+#else
+    uint64_t id = (uint32_t)getpid();
+#endif
+
+    /* 0 is no lease */
+    if (++nr_leases == 0)
+        nr_leases = 1;
+    return (id << 32) | nr_leases;
+}
+
+static void lock_shard(struct page_cache_shard *shard)
+{
+    /* a worker died holding the lock; the shard may be half updated */
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD) {
+        HFLOG_WARN("Reset a shard of the page cache locked by a dead worker\n");
+        reset_shard(shard);
+        pthread_mutex_consistent(&shard->lock);
+    }
+}
+
+static int cmp_fields(const void *a, const void *b)
+{
+    return strcmp(*(const char **)a, *(const char **)b);
+}
+
+char *page_cache_make_key(const char *script, const char *query,
+        const char *variant)
+{
+    size_t script_len = strlen(script);
+    size_t query_len = query ? strlen(query) : 0;
+    size_t variant_len = variant ? strlen(variant) : 0;
+
+    char *key = malloc(script_len + query_len + variant_len + 3);
+    if (key == NULL)
+        return NULL;
+
+    memcpy(key, script, script_len);
+    char *p = key + script_len;
+    *p++ = '?';
+
+    if (query_len > 0) {
+        size_t nr_fields = 1;
+        for (const char *c = query; *c; c++) {
+            if (*c == '&')
+                nr_fields++;
+        }
+
+        char *buf = strdup(query);
+        const char **fields = malloc(sizeof(fields[0]) * nr_fields);
+        if (buf == NULL || fields == NULL) {
+            free(buf);
+            free(fields);
+            free(key);
+            return NULL;
+        }
+
+        /* empty fields (`a=1&&b=2`) do not count */
+        size_t n = 0;
+        char *saveptr;
+        for (char *field = strtok_r(buf, "&", &saveptr); field;
+                field = strtok_r(NULL, "&", &saveptr)) {
+            fields[n++] = field;
+        }
+
+        qsort(fields, n, sizeof(fields[0]), cmp_fields);
+        for (size_t i = 0; i < n; i++) {
+            size_t len = strlen(fields[i]);
+            if (i > 0)
+                *p++ = '&';
+            memcpy(p, fields[i], len);
+            p += len;
+        }
+
+        free(fields);
+        free(buf);
+    }
+
+    /* a fragment is never sent, so `#` cannot be in the query */
+    if (variant_len > 0) {
+        *p++ = '#';
+        memcpy(p, variant, variant_len);
+        p += variant_len;
+    }
+
+    *p = 0;
+    return key;
+}
+
+/* Copies len bytes from offset of the blocks of the entry into buf. */
+static void read_blocks(struct page_cache_shard *shard,
+        const struct page_cache_entry *entry, size_t offset,
+        char *buf, size_t len)
+{
+    uint32_t *next_block = NEXT_BLOCK(shard);
+    uint32_t block = entry->first_block;
+
+    while (offset >= BLOCK_SIZE) {
+        block = next_block[block];
+        offset -= BLOCK_SIZE;
+    }
+
+    while (len > 0) {
+        size_t n = BLOCK_SIZE - offset;
+        if (n > len)
+            n = len;
+
+        memcpy(buf, BLOCK(shard, block) + offset, n);
+        buf += n;
+        len -= n;
+        offset = 0;
+        block = next_block[block];
+    }
+}
+
+static bool key_matches(struct page_cache_shard *shard,
+        const struct page_cache_entry *entry, const char *key, size_t len)
+{
+    uint32_t *next_block = NEXT_BLOCK(shard);
+    uint32_t block = entry->first_block;
+
+    while (len > 0) {
+        size_t n = (len > BLOCK_SIZE) ? BLOCK_SIZE : len;
+        if (memcmp(BLOCK(shard, block), key, n))
+            return false;
+
+        key += n;
+        len -= n;
+        block = next_block[block];
+    }
+
+    return true;
+}
+
+static uint32_t *find_entry(struct page_cache_shard *shard, uint64_t hash,
+        const char *key, size_t key_len)
+{
+    struct page_cache_entry *entries = ENTRIES(shard);
+    uint32_t *slot = BUCKETS(shard) +
+        ((hash / NR_SHARDS) & (cache->nr_buckets - 1));
+
+    while (*slot != NIL) {
+        struct page_cache_entry *entry = entries + *slot;
+        if (entry->hash == hash && entry->key_len == key_len &&
+                key_matches(shard, entry, key, key_len))
+            return slot;
+        slot = &entry->next;
+    }
+
+    return NULL;
+}
+
+/* Removes the entry referred to by the slot in a hash chain. */
+static void remove_entry(struct page_cache_shard *shard, uint32_t *slot)
+{
+    struct page_cache_entry *entry = ENTRIES(shard) + *slot;
+    uint32_t index = *slot;
+    uint32_t *next_block = NEXT_BLOCK(shard);
+
+    *slot = entry->next;
+
+    uint32_t last = entry->first_block;
+    while (next_block[last] != NIL)
+        last = next_block[last];
+    next_block[last] = shard->free_blocks;
+    shard->free_blocks = entry->first_block;
+    shard->nr_free_blocks += entry->nr_blocks;
+    shard->size -= entry->key_len + entry->etag_len +
+        entry->hdr_len + entry->body_len;
+
+    entry->used = 0;
+    entry->next = shard->free_entries;
+    shard->free_entries = index;
+}
+
+static void evict_entry(struct page_cache_shard *shard, uint32_t index)
+{
+    struct page_cache_entry *entry = ENTRIES(shard) + index;
+    uint32_t *slot = BUCKETS(shard) +
+        ((entry->hash / NR_SHARDS) & (cache->nr_buckets - 1));
+
+    while (*slot != index)
+        slot = &ENTRIES(shard)[*slot].next;
+
+    remove_entry(shard, slot);
+}
+
+/*
+ * Evicts one entry by the CLOCK algorithm: the hand sweeps the entries,
+ * giving a second chance to the ones referenced since the last sweep.
+ * Expired entries go first; the ones leased to a request making the page
+ * are never evicted.
+ */
+static bool evict_one(struct page_cache_shard *shard)
+{
+    struct page_cache_entry *entries = ENTRIES(shard);
+    time_t t = now();
+
+    for (uint32_t n = 0; n < cache->nr_entries * 2; n++) {
+        uint32_t index = shard->clock_hand;
+        shard->clock_hand = (index + 1) % cache->nr_entries;
+
+        struct page_cache_entry *entry = entries + index;
+        if (!entry->used)
+            continue;
+
+        /* the request making the page still holds the entry */
+        if (entry->filler && entry->fill_deadline > t)
+            continue;
+
+        if (entry->referenced && entry->stale_until > t) {
+            entry->referenced = 0;
+            continue;
+        }
+
+        evict_entry(shard, index);
+        return true;
+    }
+
+    return false;
+}
+
+/* Copies the page of the entry out, not to hold the lock while sending it. */
+static bool copy_page(struct page_cache_shard *shard,
+        const struct page_cache_entry *entry, struct page_cache_hit *hit)
+{
+    size_t len = entry->etag_len + entry->hdr_len + entry->body_len;
+    if (len > hit_buf_size) {
+        char *buf = realloc(hit_buf, len);
+        if (buf == NULL)
+            return false;
+        hit_buf = buf;
+        hit_buf_size = len;
+    }
+
+    read_blocks(shard, entry, entry->key_len, hit_buf, len);
+
+    hit->etag = entry->etag_len ? hit_buf : NULL;
+    hit->data = hit_buf + entry->etag_len;
+    hit->hdr_len = entry->hdr_len;
+    hit->body_len = entry->body_len;
+    return true;
+}
+
+/* Copies a piece of the page into the blocks, going on from *block. */
+static void write_blocks(struct page_cache_shard *shard, uint32_t *block,
+        size_t *offset, const char *data, size_t len)
+{
+    uint32_t *next_block = NEXT_BLOCK(shard);
+
+    while (len > 0) {
+        if (*offset == BLOCK_SIZE) {
+            *block = next_block[*block];
+            *offset = 0;
+        }
+
+        size_t n = BLOCK_SIZE - *offset;
+        if (n > len)
+            n = len;
+
+        memcpy(BLOCK(shard, *block) + *offset, data, n);
+        data += n;
+        len -= n;
+        *offset += n;
+    }
+}
+
+/*
+ * Takes a free entry and the blocks for size bytes, evicting others if
+ * need be, and links the entry to the hash index.  The caller fills in
+ * the entry and the blocks.
+ */
+static struct page_cache_entry *alloc_entry(struct page_cache_shard *shard,
+        uint64_t hash, size_t size)
+{
+    size_t nr_blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    while (shard->nr_free_blocks < nr_blocks ||
+            shard->free_entries == NIL) {
+        if (!evict_one(shard))
+            return NULL;
+    }
+
+    uint32_t index = shard->free_entries;
+    struct page_cache_entry *entry = ENTRIES(shard) + index;
+    shard->free_entries = entry->next;
+
+    /* take the blocks from the free list */
+    uint32_t *next_block = NEXT_BLOCK(shard);
+    uint32_t last = shard->free_blocks;
+    for (size_t i = 1; i < nr_blocks; i++)
+        last = next_block[last];
+    entry->first_block = shard->free_blocks;
+    shard->free_blocks = next_block[last];
+    next_block[last] = NIL;
+    shard->nr_free_blocks -= nr_blocks;
+
+    entry->hash = hash;
+    entry->expires = 0;
+    entry->stale_until = 0;
+    entry->nr_blocks = nr_blocks;
+    entry->used = 1;
+    entry->referenced = 0;
+    entry->has_page = 0;
+    entry->filler = 0;
+    entry->fill_deadline = 0;
+    entry->etag_len = 0;
+    entry->hdr_len = 0;
+    entry->body_len = 0;
+
+    uint32_t *bucket = BUCKETS(shard) +
+        ((hash / NR_SHARDS) & (cache->nr_buckets - 1));
+    entry->next = *bucket;
+    *bucket = index;
+
+    shard->size += size;
+    return entry;
+}
+
+bool page_cache_store(const char *key, unsigned ttl, unsigned grace,
+        const char *etag, const char *headers, size_t hdr_len,
+        const char *body, size_t body_len)
+{
+    if (cache == NULL || ttl == 0)
+        return false;
+
+    size_t key_len = strlen(key);
+    size_t etag_len = etag ? strlen(etag) + 1 : 0;
+    size_t size = key_len + etag_len + hdr_len + body_len;
+
+    /* a page taking much of the shard would evict too many others */
+    if ((size + BLOCK_SIZE - 1) / BLOCK_SIZE > cache->nr_blocks / 8)
+        return false;
+
+    uint64_t hash = hash_key(key, key_len);
+    struct page_cache_shard *shard = SHARD(hash % NR_SHARDS);
+
+    lock_shard(shard);
+
+    /* replacing the old entry also ends the lease on it */
+    uint32_t *slot = find_entry(shard, hash, key, key_len);
+    if (slot)
+        remove_entry(shard, slot);
+
+    struct page_cache_entry *entry = alloc_entry(shard, hash, size);
+    if (entry) {
+        uint32_t block = entry->first_block;
+        size_t offset = 0;
+        write_blocks(shard, &block, &offset, key, key_len);
+        write_blocks(shard, &block, &offset, etag, etag_len);
+        write_blocks(shard, &block, &offset, headers, hdr_len);
+        write_blocks(shard, &block, &offset, body, body_len);
+
+        entry->expires = now() + ttl;
+        entry->stale_until = entry->expires + grace;
+        entry->key_len = key_len;
+        entry->etag_len = etag_len;
+        entry->hdr_len = hdr_len;
+        entry->body_len = body_len;
+        entry->has_page = 1;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+    return entry != NULL;
+}
+
+enum page_cache_result
+page_cache_lookup(const char *key, uint64_t lease,
+        struct page_cache_hit *hit)
+{
+    if (cache == NULL)
+        return PAGE_CACHE_MISS;
+
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_key(key, key_len);
+    struct page_cache_shard *shard = SHARD(hash % NR_SHARDS);
+    enum page_cache_result result = PAGE_CACHE_MISS;
+    struct page_cache_entry *entry = NULL;
+    time_t t = now();
+
+    lock_shard(shard);
+
+    uint32_t *slot = find_entry(shard, hash, key, key_len);
+    if (slot) {
+        entry = ENTRIES(shard) + *slot;
+
+        if (entry->has_page && entry->expires > t) {
+            entry->referenced = 1;
+            if (copy_page(shard, entry, hit))
+                result = PAGE_CACHE_HIT;
+            goto done;
+        }
+
+        /* another worker is making the page */
+        if (entry->filler && entry->fill_deadline > t) {
+            if (entry->has_page && entry->stale_until > t &&
+                    copy_page(shard, entry, hit))
+                result = PAGE_CACHE_HIT;
+            else
+                result = PAGE_CACHE_BUSY;
+            goto done;
+        }
+
+        /* serve the expired page while making the new one */
+        if (entry->has_page && entry->stale_until > t &&
+                copy_page(shard, entry, hit))
+            result = PAGE_CACHE_STALE;
+    }
+    else {
+        /* an entry without page, only to hold the lease */
+        entry = alloc_entry(shard, hash, key_len);
+        if (entry) {
+            uint32_t block = entry->first_block;
+            size_t offset = 0;
+            write_blocks(shard, &block, &offset, key, key_len);
+            entry->key_len = key_len;
+        }
+    }
+
+    if (entry) {
+        entry->filler = lease;
+        entry->fill_deadline = t + FILL_LEASE;
+    }
+
+done:
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+void page_cache_release(const char *key, uint64_t lease)
+{
+    if (cache == NULL)
+        return;
+
+    size_t key_len = strlen(key);
+    uint64_t hash = hash_key(key, key_len);
+    struct page_cache_shard *shard = SHARD(hash % NR_SHARDS);
+
+    lock_shard(shard);
+
+    uint32_t *slot = find_entry(shard, hash, key, key_len);
+    if (slot) {
+        struct page_cache_entry *entry = ENTRIES(shard) + *slot;
+        if (entry->filler == lease) {
+            entry->filler = 0;
+            if (!entry->has_page)
+                remove_entry(shard, slot);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
@@ -0,0 +1,121 @@
+/*
+** @file page-cache.h
+** @author Vincent Wei
+** @date 2026/10/18
+** @brief The interface of the full-page output cache.
+**
+** Copyright (C) 2023 FMSoft <https://www.fmsoft.cn>
+**
+** This file is a part of hvml-fpm, which is an HVML FastCGI implementation.
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef page_cache_h
+#define page_cache_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PAGE_CACHE_DEF_SIZE     (64 * 1024 * 1024)
+#define PAGE_CACHE_MAX_SIZE     (16ULL * 1024 * 1024 * 1024)
+
+/*
+ * The page cache keeps whole responses, i.e. the header section and
+ * the body, keyed by the script and the normalized query string.
+ * It lives in shared memory, so that the workers share the pages;
+ * the entries not used recently are evicted when the cache is full.
+ */
+struct page_cache_hit {
+    /* the header section followed by the body */
+    const char *data;
+    size_t hdr_len;
+    size_t body_len;
+
+    /* the entity tag of the body; NULL if there is none */
+    const char *etag;
+};
+
+enum page_cache_result {
+    PAGE_CACHE_HIT,
+    /* the caller makes the page; it holds the lease until it stores
+       or releases the page */
+    PAGE_CACHE_MISS,
+    /* another worker is making the page */
+    PAGE_CACHE_BUSY,
+    /* the expired page in its grace period is a hit; the caller makes
+       the new page after sending it, holding the lease as on a miss */
+    PAGE_CACHE_STALE,
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Maps the page cache of about max_size bytes, at most PAGE_CACHE_MAX_SIZE.
+ * Call it before forking the workers to share the cache among them;
+ * it does nothing if the cache is mapped already.
+ */
+int page_cache_init(size_t max_size);
+
+void page_cache_cleanup(void);
+
+/* Frees the copy of the last hit kept for the calling thread. */
+void page_cache_thread_cleanup(void);
+
+/*
+ * Makes the key for the script and the query string; the fields of
+ * the query are sorted, so that `a=1&b=2` and `b=2&a=1` share the page.
+ * The variant (NULL for none) tells apart the pages made differently
+ * for the same request, e.g. the compressed ones.
+ * The caller frees the key.
+ */
+char *page_cache_make_key(const char *script, const char *query,
+        const char *variant);
+
+/*
+ * Makes the token of the leases taken for a request, which tells apart
+ * the requests run at a time by all the workers and their threads.
+ */
+uint64_t page_cache_new_lease(void);
+
+/*
+ * Looks up a fresh page and copies it out; the data of the hit stays
+ * valid until the next lookup.  While another worker is making the page,
+ * the expired page is a hit in its grace period.  The lease taken on a miss
+ * is the given one.
+ */
+enum page_cache_result
+page_cache_lookup(const char *key, uint64_t lease,
+        struct page_cache_hit *hit);
+
+/*
+ * Stores a page (copied) which stays fresh for ttl seconds, then is
+ * served for grace seconds more while it is being made again.
+ */
+bool page_cache_store(const char *key, unsigned ttl, unsigned grace,
+        const char *etag, const char *headers, size_t hdr_len,
+        const char *body, size_t body_len);
+
+/* Gives up the lease taken by a missing lookup if the page is not stored. */
+void page_cache_release(const char *key, uint64_t lease);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif  /* page_cache_h */
+
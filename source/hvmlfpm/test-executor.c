@@ -38,11 +38,21 @@
 #include "mpart-body-processor.h"
 #include "libfcgi/fcgi_stdio.h"
 
+/* the names of the parameters set by the last FCGI_Accept() */
+static char *param_names[256];
+static int nr_params;
+
 int FCGI_Accept(void)
 {
     char buf[1024];
     char *line;
 
+    for (int i = 0; i < nr_params; i++) {
+        unsetenv(param_names[i]);
+        free(param_names[i]);
+    }
+    nr_params = 0;
+
     while (true) {
         line = fgets(buf, sizeof(buf), stdin);
 
@@ -65,8 +75,10 @@ int FCGI_Accept(void)
             value_len--;
         }
 
-        if (value_len > 0)
+        if (value_len > 0 && nr_params < (int)PCA_TABLESIZE(param_names)) {
             setenv(line, value, 1);
+            param_names[nr_params++] = strdup(line);
+        }
     }
 
     return 0;
@@ -75,11 +87,44 @@ finish:
     return -1;
 }
 
+void FCGX_InitParamKey(FCGX_ParamKey *key, const char *name)
+{
+    key->name = name;
+    key->len = strlen(name);
+    key->hash = 0;
+}
+
+const char *FCGI_LookupParam(const FCGX_ParamKey *key, int *valueLen)
+{
+    const char *value = getenv(key->name);
+    if (value && valueLen)
+        *valueLen = strlen(value);
+    return value;
+}
+
+int FCGI_GetParamCount(void)
+{
+    return nr_params;
+}
+
+int FCGI_GetParamAt(int i, FCGX_Param *param)
+{
+    if (i < 0 || i >= nr_params)
+        return -1;
+
+    param->name = param_names[i];
+    param->nameLen = strlen(param_names[i]);
+    param->value = getenv(param_names[i]);
+    param->valueLen = strlen(param->value);
+    return 0;
+}
+
 int main(int argc, const char *argv[])
 {
     (void)argc;
     (void)argv;
-    hvml_executor("cn.fmsoft.hybridos.test", NULL, NULL, 0, true);
+    hvml_executor("cn.fmsoft.hybridos.test", NULL, NULL, NULL, false, NULL,
+            NULL, false, 1, 1, 0, 0, true);
     return EXIT_SUCCESS;
 }
 
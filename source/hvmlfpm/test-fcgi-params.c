@@ -0,0 +1,447 @@
+/*
+ * @file test-fcgi-params.c
+ * @author Vincent Wei
+ * @date 2026/10/18
+ * @brief The test program of the parameters of FastCGI requests.
+ *
+ * Copyright (C) 2023 FMSoft <https://www.fmsoft.cn>
+ *
+ * This file is a part of hvml-fpm, which is an HVML FastCGI implementation.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* the arena and the index of the parameters are checked from the inside */
+#include "libfcgi/fcgiapp.c"
+
+static int nr_failures;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__,  \
+                    #cond);                                             \
+            nr_failures++;                                              \
+        }                                                               \
+    } while (0)
+
+#define TEST_SOCKET_PATH    "/tmp/test-fcgi-params.sock"
+
+/* the records sent by a fake Web server on one connection */
+struct records {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+};
+
+static void append(struct records *recs, const void *data, size_t len)
+{
+    if (recs->len + len > recs->size) {
+        recs->size = (recs->len + len) * 2;
+        recs->data = realloc(recs->data, recs->size);
+        assert(recs->data);
+    }
+    memcpy(recs->data + recs->len, data, len);
+    recs->len += len;
+}
+
+/* Appends the records of a stream; an empty record ends the stream. */
+static void append_stream(struct records *recs, int type,
+        const void *content, size_t len)
+{
+    const unsigned char *p = content;
+
+    do {
+        size_t n = len > 0xffff ? 0xffff : len;
+        FCGI_Header header = MakeHeader(type, 1, n, 0);
+
+        append(recs, &header, sizeof(header));
+        append(recs, p, n);
+        p += n;
+        len -= n;
+    } while (len > 0);
+}
+
+static void append_length(struct records *params, size_t len)
+{
+    if (len < 0x80) {
+        unsigned char c = len;
+        append(params, &c, 1);
+    }
+    else {
+        unsigned char buf[4] = { (len >> 24) | 0x80, len >> 16, len >> 8,
+            len };
+        append(params, buf, sizeof(buf));
+    }
+}
+
+/* Appends a name-value pair to the content of the PARAMS stream. */
+static void append_param(struct records *params, const char *name,
+        const char *value, size_t value_len)
+{
+    append_length(params, strlen(name));
+    append_length(params, value_len);
+    append(params, name, strlen(name));
+    append(params, value, value_len);
+}
+
+/* Sends a request of the responder role with the given parameters. */
+static int send_request(const struct records *params)
+{
+    struct records recs = { NULL, 0, 0 };
+    FCGI_BeginRequestRecord begin;
+
+    begin.header = MakeHeader(FCGI_BEGIN_REQUEST, 1, sizeof(begin.body), 0);
+    memset(&begin.body, 0, sizeof(begin.body));
+    begin.body.roleB0 = FCGI_RESPONDER;
+    append(&recs, &begin, sizeof(begin));
+    append_stream(&recs, FCGI_PARAMS, params->data, params->len);
+    append_stream(&recs, FCGI_PARAMS, NULL, 0);
+    append_stream(&recs, FCGI_STDIN, NULL, 0);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, TEST_SOCKET_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("Failed to connect");
+        exit(EXIT_FAILURE);
+    }
+
+    /* queued on the socket until the request is accepted; the end of the
+       request spares the lingering close of the connection */
+    if (write(fd, recs.data, recs.len) != (ssize_t)recs.len ||
+            shutdown(fd, SHUT_WR)) {
+        perror("Failed to send a request");
+        exit(EXIT_FAILURE);
+    }
+
+    free(recs.data);
+    return fd;
+}
+
+static const char *lookup(FCGX_Request *request, const char *name, int *len)
+{
+    FCGX_ParamKey key;
+
+    FCGX_InitParamKey(&key, name);
+    return FCGX_LookupParam(&key, request, len);
+}
+
+static int count_blocks(ParamsPtr paramsPtr)
+{
+    int n = 0;
+    for (ArenaBlock *block = paramsPtr->arena; block; block = block->next)
+        n++;
+    return n;
+}
+
+/*
+ * The parameters fill one arena block, then one more, and a value bigger
+ * than a block gets a block of its own; none moves.  Finishing the request
+ * leaves one block as big as all of them, reused by the next request.
+ */
+static void test_arena(FCGX_Request *request)
+{
+    struct records params = { NULL, 0, 0 };
+    char name[32], value[64];
+    int nr_small = 2 * PARAMS_ARENA_SIZE / (int)PARAM_ENTRY_SIZE(8, 16);
+
+    for (int i = 0; i < nr_small; i++) {
+        snprintf(name, sizeof(name), "SMALL%03d", i);
+        int n = snprintf(value, sizeof(value), "value of %03d", i);
+        append_param(&params, name, value, n);
+    }
+
+    size_t big_len = 3 * PARAMS_ARENA_SIZE;
+    char *big = malloc(big_len);
+    for (size_t i = 0; i < big_len; i++)
+        big[i] = 'a' + i % 26;
+    append_param(&params, "BIG", big, big_len);
+
+    int fd = send_request(&params);
+    CHECK(FCGX_Accept_r(request) == 0);
+
+    ParamsPtr paramsPtr = request->paramsPtr;
+    CHECK(count_blocks(paramsPtr) >= 3);
+    CHECK(paramsPtr->arena->size >= PARAM_ENTRY_SIZE(3, big_len));
+    CHECK(FCGX_GetParamCount(request) == nr_small + 2);
+
+    for (int i = 0; i < nr_small; i++) {
+        snprintf(name, sizeof(name), "SMALL%03d", i);
+        int n = snprintf(value, sizeof(value), "value of %03d", i);
+        int len = -1;
+        const char *v = lookup(request, name, &len);
+        CHECK(v && len == n && strcmp(v, value) == 0);
+    }
+
+    int len = -1;
+    const char *v = lookup(request, "BIG", &len);
+    CHECK(v && len == (int)big_len && memcmp(v, big, big_len) == 0 &&
+            v[big_len] == '\0');
+
+    /* also handed out as environ */
+    CHECK(strcmp(FCGX_GetParam("SMALL000", request->envp),
+                "value of 000") == 0);
+
+    FCGX_Param param;
+    CHECK(FCGX_GetParamAt(request, nr_small + 1, &param) == 0);
+    CHECK(param.nameLen == 3 && strcmp(param.name, "BIG") == 0);
+    CHECK(param.valueLen == (int)big_len && param.value == v);
+    CHECK(FCGX_GetParamAt(request, nr_small + 2, &param) == -1);
+
+    size_t arena_size = paramsPtr->arenaSize;
+    FCGX_Finish_r(request);
+    close(fd);
+
+    CHECK(request->paramsPtr == paramsPtr);
+    CHECK(count_blocks(paramsPtr) == 1);
+    CHECK(paramsPtr->arena->size == arena_size);
+    CHECK(paramsPtr->arena->used == 0);
+    CHECK(paramsPtr->indexUsed == 0);
+    CHECK(FCGX_GetParamCount(request) == 0);
+    CHECK(lookup(request, "SMALL000", NULL) == NULL);
+
+    /* the same request again fits in the block */
+    ArenaBlock *block = paramsPtr->arena;
+    fd = send_request(&params);
+    CHECK(FCGX_Accept_r(request) == 0);
+    CHECK(paramsPtr->arena == block && block->next == NULL);
+    CHECK(FCGX_GetParamCount(request) == nr_small + 2);
+    v = lookup(request, "BIG", &len);
+    CHECK(v && len == (int)big_len && memcmp(v, big, big_len) == 0);
+    FCGX_Finish_r(request);
+    close(fd);
+
+    free(big);
+    free(params.data);
+}
+
+/*
+ * A connection whose parameters are cut short is closed, and the next one
+ * is accepted; nothing of the first is left in the parameters.
+ */
+static void test_try_again(FCGX_Request *request)
+{
+    struct records bad = { NULL, 0, 0 };
+    struct records good = { NULL, 0, 0 };
+
+    append_param(&bad, "STALE", "1", 1);
+    append_length(&bad, 200);
+    append_length(&bad, 1);
+    append(&bad, "SHORT", 5);
+
+    append_param(&good, "SCRIPT_NAME", "/index.hvml", 11);
+
+    int bad_fd = send_request(&bad);
+    int good_fd = send_request(&good);
+    CHECK(FCGX_Accept_r(request) == 0);
+
+    /* FCGI_ROLE and SCRIPT_NAME */
+    CHECK(FCGX_GetParamCount(request) == 2);
+    CHECK(request->paramsPtr->indexUsed == 2);
+    CHECK(lookup(request, "STALE", NULL) == NULL);
+    CHECK(FCGX_GetParam("STALE", request->envp) == NULL);
+
+    const char *v = lookup(request, "SCRIPT_NAME", NULL);
+    CHECK(v && strcmp(v, "/index.hvml") == 0);
+    v = lookup(request, "FCGI_ROLE", NULL);
+    CHECK(v && strcmp(v, "RESPONDER") == 0);
+
+    FCGX_Finish_r(request);
+    close(bad_fd);
+    close(good_fd);
+    free(bad.data);
+    free(good.data);
+}
+
+/* the FNV-1a hash and the name of a parameter */
+struct hashed_name {
+    unsigned int hash;
+    char name[8];
+};
+
+static int cmp_hashed_names(const void *a, const void *b)
+{
+    const struct hashed_name *x = a, *y = b;
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+/* Finds two names of the same length having the same 32-bit hash. */
+static bool find_colliding_names(char *name1, char *name2)
+{
+    size_t nr_names = 1 << 20;
+    struct hashed_name *names = malloc(nr_names * sizeof(names[0]));
+    bool found = false;
+
+    for (size_t i = 0; i < nr_names; i++) {
+        snprintf(names[i].name, sizeof(names[i].name), "C%05zx", i);
+        names[i].hash = HashName(names[i].name, strlen(names[i].name));
+    }
+
+    qsort(names, nr_names, sizeof(names[0]), cmp_hashed_names);
+    for (size_t i = 1; i < nr_names; i++) {
+        if (names[i].hash == names[i - 1].hash) {
+            strcpy(name1, names[i - 1].name);
+            strcpy(name2, names[i].name);
+            found = true;
+            break;
+        }
+    }
+
+    free(names);
+    return found;
+}
+
+/*
+ * The keys hash with FNV-1a.  The index doubles while the parameters come,
+ * finds the names sharing a slot or the whole hash, finds the first of
+ * several parameters of the same name, and finds nothing for the others.
+ */
+static void test_index(FCGX_Request *request)
+{
+    FCGX_ParamKey key;
+
+    FCGX_InitParamKey(&key, "");
+    CHECK(key.len == 0 && key.hash == 0x811c9dc5U);
+    FCGX_InitParamKey(&key, "a");
+    CHECK(key.len == 1 && key.hash == 0xe40c292cU);
+    FCGX_InitParamKey(&key, "foobar");
+    CHECK(strcmp(key.name, "foobar") == 0);
+    CHECK(key.len == 6 && key.hash == 0xbf9cf968U);
+
+    char colliding1[8], colliding2[8];
+    CHECK(find_colliding_names(colliding1, colliding2));
+
+    struct records params = { NULL, 0, 0 };
+    char name[32], value[64];
+    int nr_params = 4 * PARAMS_INDEX_SIZE;
+
+    for (int i = 0; i < nr_params; i++) {
+        snprintf(name, sizeof(name), "P%03d", i);
+        int n = snprintf(value, sizeof(value), "%d", i);
+        append_param(&params, name, value, n);
+    }
+    append_param(&params, "DUP", "first", 5);
+    append_param(&params, "DUP", "second", 6);
+    append_param(&params, colliding1, "one", 3);
+    append_param(&params, colliding2, "two", 3);
+
+    int fd = send_request(&params);
+    CHECK(FCGX_Accept_r(request) == 0);
+
+    /* FCGI_ROLE, the Pxxx, DUP twice, and the colliding ones */
+    ParamsPtr paramsPtr = request->paramsPtr;
+    CHECK(FCGX_GetParamCount(request) == nr_params + 5);
+    CHECK(paramsPtr->indexUsed == nr_params + 4);
+    CHECK(paramsPtr->indexSize >= 2 * paramsPtr->indexUsed);
+    CHECK((paramsPtr->indexSize & (paramsPtr->indexSize - 1)) == 0);
+
+    /* some entries are not in their own slots */
+    int nr_moved = 0;
+    unsigned int mask = paramsPtr->indexSize - 1;
+    for (int i = 0; i < paramsPtr->indexSize; i++) {
+        ParamEntry *entry = paramsPtr->index[i];
+        if (entry && (entry->hash & mask) != (unsigned int)i)
+            nr_moved++;
+    }
+    CHECK(nr_moved > 0);
+
+    for (int i = 0; i < nr_params; i++) {
+        snprintf(name, sizeof(name), "P%03d", i);
+        int n = snprintf(value, sizeof(value), "%d", i);
+        int len = -1;
+        const char *v = lookup(request, name, &len);
+        CHECK(v && len == n && strcmp(v, value) == 0);
+    }
+
+    /* like getenv() */
+    const char *v = lookup(request, "DUP", NULL);
+    CHECK(v && strcmp(v, "first") == 0);
+
+    v = lookup(request, colliding1, NULL);
+    CHECK(v && strcmp(v, "one") == 0);
+    v = lookup(request, colliding2, NULL);
+    CHECK(v && strcmp(v, "two") == 0);
+
+    static const char *missing[] = {
+        "", "P", "P00", "P0000", "p000", "Q000", "DUPS", "DU", "C",
+    };
+    for (size_t i = 0; i < sizeof(missing) / sizeof(missing[0]); i++) {
+        int len = -1;
+        CHECK(lookup(request, missing[i], &len) == NULL && len == -1);
+    }
+
+    /* the hash must be the one of the name */
+    FCGX_InitParamKey(&key, "P000");
+    key.hash ^= 1;
+    CHECK(FCGX_LookupParam(&key, request, NULL) == NULL);
+
+    FCGX_InitParamKey(&key, "P000");
+    CHECK(FCGX_LookupParam(NULL, request, NULL) == NULL);
+    CHECK(FCGX_LookupParam(&key, NULL, NULL) == NULL);
+
+    /* the grown index is kept, but emptied, for the next request */
+    int index_size = paramsPtr->indexSize;
+    FCGX_Finish_r(request);
+    close(fd);
+
+    CHECK(paramsPtr->indexSize == index_size);
+    CHECK(paramsPtr->indexUsed == 0);
+    CHECK(FCGX_LookupParam(&key, request, NULL) == NULL);
+
+    free(params.data);
+}
+
+int main(void)
+{
+    /* the fake Web server does not read the responses */
+    signal(SIGPIPE, SIG_IGN);
+
+    unlink(TEST_SOCKET_PATH);
+    if (FCGX_Init()) {
+        fprintf(stderr, "Failed FCGX_Init()\n");
+        return EXIT_FAILURE;
+    }
+
+    int sock = FCGX_OpenSocket(TEST_SOCKET_PATH, 8);
+    if (sock < 0) {
+        fprintf(stderr, "Failed to listen on %s\n", TEST_SOCKET_PATH);
+        return EXIT_FAILURE;
+    }
+
+    FCGX_Request request;
+    FCGX_InitRequest(&request, sock, 0);
+
+    test_arena(&request);
+    test_try_again(&request);
+    test_index(&request);
+
+    FCGX_Free(&request, 1);
+    close(sock);
+    unlink(TEST_SOCKET_PATH);
+
+    if (nr_failures) {
+        fprintf(stderr, "%d check(s) failed\n", nr_failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}
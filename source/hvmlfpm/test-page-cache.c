@@ -0,0 +1,355 @@
+/*
+ * @file test-page-cache.c
+ * @author Vincent Wei
+ * @date 2026/10/18
+ * @brief The test program of the full-page output cache.
+ *
+ * Copyright (C) 2023 FMSoft <https://www.fmsoft.cn>
+ *
+ * This file is a part of hvml-fpm, which is an HVML FastCGI implementation.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <sys/wait.h>
+
+/* the shards, the entries, and the lock are checked from the inside */
+#include "page-cache.c"
+
+static int nr_failures;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__,  \
+                    #cond);                                             \
+            nr_failures++;                                              \
+        }                                                               \
+    } while (0)
+
+/* the smallest cache: 16 blocks and 8 entries a shard */
+#define TEST_CACHE_SIZE     0
+
+static const char headers[] = "Content-Type: text/plain\r\n\r\n";
+
+static bool store_page(const char *key, unsigned ttl, unsigned grace)
+{
+    char body[128];
+    int n = snprintf(body, sizeof(body), "the page of %s", key);
+
+    return page_cache_store(key, ttl, grace, NULL, headers,
+            sizeof(headers) - 1, body, n);
+}
+
+/* Tells whether the hit is the page stored by store_page() for the key. */
+static bool is_page_of(const struct page_cache_hit *hit, const char *key)
+{
+    char body[128];
+    int n = snprintf(body, sizeof(body), "the page of %s", key);
+
+    return hit->hdr_len == sizeof(headers) - 1 &&
+        memcmp(hit->data, headers, hit->hdr_len) == 0 &&
+        hit->body_len == (size_t)n &&
+        memcmp(hit->data + hit->hdr_len, body, n) == 0;
+}
+
+/* Makes the i-th key falling in the shard. */
+static void make_shard_key(char *key, size_t size, unsigned shard, int i)
+{
+    for (int j = 0; ; j++) {
+        snprintf(key, size, "/shard%u.hvml?n=%d", shard, j);
+        if (hash_key(key, strlen(key)) % NR_SHARDS == shard && i-- == 0)
+            break;
+    }
+}
+
+/* Tells whether the key has an entry, without referencing it. */
+static bool has_entry(const char *key)
+{
+    size_t len = strlen(key);
+    uint64_t hash = hash_key(key, len);
+    struct page_cache_shard *shard = SHARD(hash % NR_SHARDS);
+
+    lock_shard(shard);
+    bool found = find_entry(shard, hash, key, len) != NULL;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
+}
+
+static struct page_cache_entry *get_entry(const char *key)
+{
+    size_t len = strlen(key);
+    uint64_t hash = hash_key(key, len);
+    struct page_cache_shard *shard = SHARD(hash % NR_SHARDS);
+
+    uint32_t *slot = find_entry(shard, hash, key, len);
+    return slot ? ENTRIES(shard) + *slot : NULL;
+}
+
+static void test_leases(void)
+{
+    struct page_cache_hit hit;
+    uint64_t a = page_cache_new_lease();
+    uint64_t b = page_cache_new_lease();
+    const char *key = "/lease.hvml?";
+
+    CHECK(a != 0 && b != 0 && a != b);
+
+    /* the first request makes the page; the others wait for it */
+    CHECK(page_cache_lookup(key, a, &hit) == PAGE_CACHE_MISS);
+    CHECK(page_cache_lookup(key, b, &hit) == PAGE_CACHE_BUSY);
+
+    /* another request of the same thread cannot end the lease */
+    page_cache_release(key, b);
+    CHECK(page_cache_lookup(key, b, &hit) == PAGE_CACHE_BUSY);
+
+    page_cache_release(key, a);
+    CHECK(!has_entry(key));
+    CHECK(page_cache_lookup(key, b, &hit) == PAGE_CACHE_MISS);
+
+    /* storing the page ends the lease */
+    CHECK(store_page(key, 60, 0));
+    CHECK(page_cache_lookup(key, a, &hit) == PAGE_CACHE_HIT &&
+            is_page_of(&hit, key));
+}
+
+static void test_grace(void)
+{
+    struct page_cache_hit hit;
+    uint64_t a = page_cache_new_lease();
+    uint64_t b = page_cache_new_lease();
+    const char *key = "/grace.hvml?";
+
+    CHECK(store_page(key, 60, 30));
+    struct page_cache_entry *entry = get_entry(key);
+    CHECK(entry != NULL);
+    if (entry == NULL)
+        return;
+
+    /* expired, in the grace period */
+    entry->expires = now() - 1;
+    entry->stale_until = now() + 30;
+    CHECK(page_cache_lookup(key, a, &hit) == PAGE_CACHE_STALE &&
+            is_page_of(&hit, key));
+    CHECK(page_cache_lookup(key, b, &hit) == PAGE_CACHE_HIT &&
+            is_page_of(&hit, key));
+
+    /* past the grace period, the others wait for the new page */
+    entry->stale_until = now() - 1;
+    CHECK(page_cache_lookup(key, b, &hit) == PAGE_CACHE_BUSY);
+
+    page_cache_release(key, a);
+    CHECK(page_cache_lookup(key, b, &hit) == PAGE_CACHE_MISS);
+    page_cache_release(key, b);
+}
+
+static void test_clock_eviction(void)
+{
+    struct page_cache_shard *shard = SHARD(1);
+    struct page_cache_hit hit;
+    uint32_t nr_entries = cache->nr_entries;
+    char keys[32][64];
+
+    CHECK(nr_entries * 2 <= sizeof(keys) / sizeof(keys[0]));
+    for (uint32_t i = 0; i < nr_entries * 2; i++)
+        make_shard_key(keys[i], sizeof(keys[i]), 1, i);
+
+    lock_shard(shard);
+    reset_shard(shard);
+    pthread_mutex_unlock(&shard->lock);
+
+    /* fill the entries of the shard, then reference the first half */
+    for (uint32_t i = 0; i < nr_entries; i++)
+        CHECK(store_page(keys[i], 60, 0));
+    for (uint32_t i = 0; i < nr_entries / 2; i++) {
+        CHECK(page_cache_lookup(keys[i], 1, &hit) == PAGE_CACHE_HIT &&
+                is_page_of(&hit, keys[i]));
+    }
+
+    /* the pages not referenced go first */
+    for (uint32_t i = nr_entries; i < nr_entries + nr_entries / 2; i++)
+        CHECK(store_page(keys[i], 60, 0));
+    for (uint32_t i = 0; i < nr_entries / 2; i++)
+        CHECK(has_entry(keys[i]));
+    for (uint32_t i = nr_entries / 2; i < nr_entries; i++)
+        CHECK(!has_entry(keys[i]));
+
+    /* the second chance is used up; the oldest pages go now */
+    CHECK(store_page(keys[nr_entries * 3 / 2], 60, 0));
+    CHECK(!has_entry(keys[0]));
+
+    /* the entries leased to the requests making the pages stay */
+    lock_shard(shard);
+    reset_shard(shard);
+    pthread_mutex_unlock(&shard->lock);
+
+    for (uint32_t i = 0; i < nr_entries; i++) {
+        CHECK(page_cache_lookup(keys[i], i + 1, &hit) == PAGE_CACHE_MISS);
+    }
+    CHECK(!store_page(keys[nr_entries], 60, 0));
+    for (uint32_t i = 0; i < nr_entries; i++)
+        CHECK(has_entry(keys[i]));
+
+    page_cache_release(keys[0], 1);
+    CHECK(store_page(keys[nr_entries], 60, 0));
+    CHECK(page_cache_lookup(keys[nr_entries], 1, &hit) == PAGE_CACHE_HIT);
+
+    /* a lease which ran out does not hold the entry any more */
+    lock_shard(shard);
+    get_entry(keys[1])->fill_deadline = now() - 1;
+    pthread_mutex_unlock(&shard->lock);
+    CHECK(store_page(keys[nr_entries + 1], 60, 0));
+    CHECK(!has_entry(keys[1]));
+
+    for (uint32_t i = 2; i < nr_entries; i++)
+        page_cache_release(keys[i], i + 1);
+}
+
+static void test_robust_lock(void)
+{
+    struct page_cache_shard *shard = SHARD(2);
+    char key[64];
+
+    make_shard_key(key, sizeof(key), 2, 0);
+    CHECK(store_page(key, 60, 0));
+
+    /* a worker dies holding the lock of the shard */
+    pid_t pid = fork();
+    if (pid == 0) {
+        pthread_mutex_lock(&shard->lock);
+        _exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    CHECK(pid > 0 && waitpid(pid, &status, 0) == pid);
+
+    /* the shard is reset, and usable again */
+    CHECK(!has_entry(key));
+    CHECK(store_page(key, 60, 0));
+    CHECK(has_entry(key));
+    CHECK(shard->nr_free_blocks < cache->nr_blocks);
+}
+
+#define NR_WORKERS          4
+#define NR_THREADS          4
+#define NR_KEYS             64
+#define NR_ROUNDS           5000
+
+/* Stores and looks up the pages of a few keys over and over. */
+static void *hammer(void *arg)
+{
+    unsigned seed = (unsigned)(uintptr_t)arg;
+    uintptr_t nr_bad = 0;
+
+    for (int i = 0; i < NR_ROUNDS; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "/hammer.hvml?k=%d",
+                rand_r(&seed) % NR_KEYS);
+
+        struct page_cache_hit hit;
+        uint64_t lease = page_cache_new_lease();
+        switch (page_cache_lookup(key, lease, &hit)) {
+        case PAGE_CACHE_HIT:
+            if (!is_page_of(&hit, key))
+                nr_bad++;
+            break;
+
+        case PAGE_CACHE_MISS:
+            if (!store_page(key, 60, 0))
+                page_cache_release(key, lease);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    page_cache_thread_cleanup();
+    return (void *)nr_bad;
+}
+
+/* The workers and their threads share the shards and their locks. */
+static void test_shard_locking(void)
+{
+    pid_t pids[NR_WORKERS];
+
+    for (int i = 0; i < NR_WORKERS; i++) {
+        pids[i] = fork();
+        if (pids[i] == 0) {
+            pthread_t threads[NR_THREADS];
+            uintptr_t nr_bad = 0;
+
+            for (int j = 0; j < NR_THREADS; j++)
+                pthread_create(threads + j, NULL, hammer,
+                        (void *)(uintptr_t)(i * NR_THREADS + j + 1));
+            for (int j = 0; j < NR_THREADS; j++) {
+                void *ret;
+                pthread_join(threads[j], &ret);
+                nr_bad += (uintptr_t)ret;
+            }
+
+            _exit(nr_bad ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+
+    for (int i = 0; i < NR_WORKERS; i++) {
+        int status;
+        CHECK(pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i] &&
+                WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+    }
+
+    /* the pages stored by the workers are seen by the master */
+    int nr_hits = 0;
+    for (int i = 0; i < NR_KEYS; i++) {
+        char key[64];
+        snprintf(key, sizeof(key), "/hammer.hvml?k=%d", i);
+
+        struct page_cache_hit hit;
+        uint64_t lease = page_cache_new_lease();
+        enum page_cache_result result = page_cache_lookup(key, lease, &hit);
+        if (result == PAGE_CACHE_HIT) {
+            CHECK(is_page_of(&hit, key));
+            nr_hits++;
+        }
+        else if (result == PAGE_CACHE_MISS) {
+            page_cache_release(key, lease);
+        }
+    }
+    CHECK(nr_hits > 0);
+}
+
+int main(void)
+{
+    if (page_cache_init(TEST_CACHE_SIZE)) {
+        fprintf(stderr, "Failed to initialize the page cache\n");
+        return EXIT_FAILURE;
+    }
+
+    test_leases();
+    test_grace();
+    test_clock_eviction();
+    test_robust_lock();
+    test_shard_locking();
+
+    page_cache_cleanup();
+
+    if (nr_failures) {
+        fprintf(stderr, "%d check(s) failed\n", nr_failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,526 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hvml-executor.h"
+#include "xml-body-processor.h"
+
+#undef NDEBUG
+#include <assert.h>
+
+#define XML_CHUNK_SIZE          4096
+#define XML_MAX_DEPTH           256
+#define XML_MAX_ENTITY_LEN      16
+
+typedef struct strbuf {
+    char *s;
+    size_t len;
+    size_t sz;
+} strbuf;
+
+/*
+ * The processor reads the stream chunk by chunk, so the memory used
+ * is bounded by the size of the chunk, the longest token, and the depth
+ * of the document, besides the variant tree made.
+ */
+typedef struct xml_body_processor {
+    purc_rwstream_t stm;
+
+    unsigned char chunk[XML_CHUNK_SIZE];
+    size_t pos;
+    size_t len;
+    bool eof;
+
+    /* the name or the attribute value being read */
+    strbuf tok;
+    /* the text being read */
+    strbuf text;
+
+    /* the open elements and their children arrays */
+    purc_variant_t elems[XML_MAX_DEPTH];
+    purc_variant_t children[XML_MAX_DEPTH];
+    int depth;
+
+    purc_variant_t root;
+} xml_body_processor;
+
+static bool strbuf_append(strbuf *buf, const char *s, size_t len)
+{
+    if (buf->len + len > buf->sz) {
+        size_t sz = buf->sz ? buf->sz : 64;
+        while (sz < buf->len + len)
+            sz *= 2;
+
+        char *tmp = realloc(buf->s, sz);
+        if (tmp == NULL) {
+            HFLOG_ERROR("Failed to allocate memory for XML token.\n");
+            return false;
+        }
+        buf->s = tmp;
+        buf->sz = sz;
+    }
+
+    memcpy(buf->s + buf->len, s, len);
+    buf->len += len;
+    return true;
+}
+
+static bool strbuf_putc(strbuf *buf, int c)
+{
+    char ch = (char)c;
+    return strbuf_append(buf, &ch, 1);
+}
+
+static int next_char(xml_body_processor *processor)
+{
+    if (processor->pos == processor->len) {
+        if (processor->eof)
+            return EOF;
+
+        ssize_t n = purc_rwstream_read(processor->stm, processor->chunk,
+                sizeof(processor->chunk));
+        if (n <= 0) {
+            processor->eof = true;
+            return EOF;
+        }
+
+        processor->len = n;
+        processor->pos = 0;
+    }
+
+    return processor->chunk[processor->pos++];
+}
+
+/* Only valid just after next_char() returned a character other than EOF. */
+static void unget_char(xml_body_processor *processor)
+{
+    assert(processor->pos > 0);
+    processor->pos--;
+}
+
+static inline bool is_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool is_name_char(int c)
+{
+    return c != EOF && !is_space(c) && strchr("<>/='\"&", c) == NULL;
+}
+
+static int skip_spaces(xml_body_processor *processor)
+{
+    int c;
+    do {
+        c = next_char(processor);
+    } while (is_space(c));
+
+    return c;
+}
+
+static bool expect(xml_body_processor *processor, const char *literal)
+{
+    while (*literal) {
+        if (next_char(processor) != (unsigned char)*literal++)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Skips the characters up to and including the terminator; they are
+ * appended to keep (without the terminator) if keep is not NULL.
+ */
+static bool skip_until(xml_body_processor *processor, const char *terminator,
+        strbuf *keep)
+{
+    size_t term_len = strlen(terminator);
+    char last[4] = { };
+    size_t nr_got = 0;
+
+    assert(term_len < sizeof(last));
+    for (;;) {
+        int c = next_char(processor);
+        if (c == EOF)
+            return false;
+
+        memmove(last, last + 1, term_len - 1);
+        last[term_len - 1] = (char)c;
+        nr_got++;
+
+        if (keep && !strbuf_putc(keep, c))
+            return false;
+
+        if (nr_got >= term_len && memcmp(last, terminator, term_len) == 0)
+            break;
+    }
+
+    if (keep)
+        keep->len -= term_len;
+    return true;
+}
+
+static bool put_utf8(strbuf *buf, unsigned long cp)
+{
+    char utf8[4];
+    size_t len;
+
+    if (cp == 0 || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+        return false;
+
+    if (cp < 0x80) {
+        utf8[0] = (char)cp;
+        len = 1;
+    }
+    else if (cp < 0x800) {
+        utf8[0] = (char)(0xC0 | (cp >> 6));
+        utf8[1] = (char)(0x80 | (cp & 0x3F));
+        len = 2;
+    }
+    else if (cp < 0x10000) {
+        utf8[0] = (char)(0xE0 | (cp >> 12));
+        utf8[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        utf8[2] = (char)(0x80 | (cp & 0x3F));
+        len = 3;
+    }
+    else {
+        utf8[0] = (char)(0xF0 | (cp >> 18));
+        utf8[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        utf8[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        utf8[3] = (char)(0x80 | (cp & 0x3F));
+        len = 4;
+    }
+
+    return strbuf_append(buf, utf8, len);
+}
+
+/* Reads an entity reference after `&`, and appends its value to buf. */
+static bool read_entity(xml_body_processor *processor, strbuf *buf)
+{
+    char name[XML_MAX_ENTITY_LEN + 1];
+    size_t len = 0;
+    int c;
+
+    while ((c = next_char(processor)) != ';') {
+        if (c == EOF || len == XML_MAX_ENTITY_LEN)
+            return false;
+        name[len++] = (char)c;
+    }
+    name[len] = 0;
+
+    if (strcmp(name, "lt") == 0)
+        return strbuf_putc(buf, '<');
+    else if (strcmp(name, "gt") == 0)
+        return strbuf_putc(buf, '>');
+    else if (strcmp(name, "amp") == 0)
+        return strbuf_putc(buf, '&');
+    else if (strcmp(name, "quot") == 0)
+        return strbuf_putc(buf, '"');
+    else if (strcmp(name, "apos") == 0)
+        return strbuf_putc(buf, '\'');
+    else if (name[0] == '#' && len > 1) {
+        char *end;
+        unsigned long cp;
+        if (name[1] == 'x')
+            cp = strtoul(name + 2, &end, 16);
+        else
+            cp = strtoul(name + 1, &end, 10);
+
+        if (*end || end == name + 1 || end == name + 2)
+            return false;
+        return put_utf8(buf, cp);
+    }
+
+    HFLOG_ERROR("Unknown XML entity: &%s;\n", name);
+    return false;
+}
+
+/* Reads a name into tok; the first character has been read already. */
+static bool read_name(xml_body_processor *processor, int c)
+{
+    processor->tok.len = 0;
+    if (!is_name_char(c))
+        return false;
+
+    do {
+        if (!strbuf_putc(&processor->tok, c))
+            return false;
+        c = next_char(processor);
+    } while (is_name_char(c));
+
+    if (c != EOF)
+        unget_char(processor);
+    return true;
+}
+
+static purc_variant_t make_tok_string(strbuf *buf)
+{
+    return purc_variant_make_string_ex(buf->s ? buf->s : "", buf->len, true);
+}
+
+/* Makes a text node of the text read, unless it has only white spaces. */
+static bool flush_text(xml_body_processor *processor)
+{
+    strbuf *text = &processor->text;
+    size_t i;
+
+    for (i = 0; i < text->len; i++) {
+        if (!is_space((unsigned char)text->s[i]))
+            break;
+    }
+
+    if (i == text->len) {
+        text->len = 0;
+        return true;
+    }
+
+    if (processor->depth == 0) {
+        HFLOG_ERROR("Text out of the root element.\n");
+        return false;
+    }
+
+    purc_variant_t v = make_tok_string(text);
+    text->len = 0;
+    if (v == PURC_VARIANT_INVALID)
+        return false;
+
+    bool success = purc_variant_array_append(
+            processor->children[processor->depth - 1], v);
+    purc_variant_unref(v);
+    return success;
+}
+
+static bool read_attribute(xml_body_processor *processor, int c,
+        purc_variant_t attr)
+{
+    if (!read_name(processor, c))
+        return false;
+
+    purc_variant_t name = make_tok_string(&processor->tok);
+    if (name == PURC_VARIANT_INVALID)
+        return false;
+
+    purc_variant_t value = PURC_VARIANT_INVALID;
+    int quote;
+    if (skip_spaces(processor) != '=')
+        goto failed;
+
+    quote = skip_spaces(processor);
+    if (quote != '"' && quote != '\'')
+        goto failed;
+
+    processor->tok.len = 0;
+    while ((c = next_char(processor)) != quote) {
+        if (c == EOF || c == '<')
+            goto failed;
+
+        if (c == '&') {
+            if (!read_entity(processor, &processor->tok))
+                goto failed;
+        }
+        else if (!strbuf_putc(&processor->tok, c)) {
+            goto failed;
+        }
+    }
+
+    value = make_tok_string(&processor->tok);
+    if (value == PURC_VARIANT_INVALID ||
+            !purc_variant_object_set(attr, name, value))
+        goto failed;
+
+    purc_variant_unref(name);
+    purc_variant_unref(value);
+    return true;
+
+failed:
+    HFLOG_ERROR("Bad XML attribute.\n");
+    purc_variant_unref(name);
+    if (value)
+        purc_variant_unref(value);
+    return false;
+}
+
+static bool start_element(xml_body_processor *processor, int c)
+{
+    purc_variant_t elem = PURC_VARIANT_INVALID, tag = PURC_VARIANT_INVALID;
+    purc_variant_t attr = PURC_VARIANT_INVALID, children = PURC_VARIANT_INVALID;
+    bool success = false;
+
+    if (!read_name(processor, c))
+        goto done;
+
+    tag = make_tok_string(&processor->tok);
+    attr = purc_variant_make_object_0();
+    children = purc_variant_make_array_0();
+    if (tag == PURC_VARIANT_INVALID || attr == PURC_VARIANT_INVALID ||
+            children == PURC_VARIANT_INVALID)
+        goto done;
+
+    elem = purc_variant_make_object_by_static_ckey(3,
+            "tag", tag, "attr", attr, "children", children);
+    if (elem == PURC_VARIANT_INVALID)
+        goto done;
+
+    bool empty;
+    for (;;) {
+        c = skip_spaces(processor);
+        if (c == '>') {
+            empty = false;
+            break;
+        }
+        else if (c == '/') {
+            if (next_char(processor) != '>')
+                goto done;
+            empty = true;
+            break;
+        }
+        else if (!read_attribute(processor, c, attr)) {
+            goto done;
+        }
+    }
+
+    if (processor->depth == 0) {
+        if (processor->root) {
+            HFLOG_ERROR("More than one root element.\n");
+            goto done;
+        }
+        processor->root = purc_variant_ref(elem);
+    }
+    else if (!purc_variant_array_append(
+                processor->children[processor->depth - 1], elem)) {
+        goto done;
+    }
+
+    if (!empty) {
+        if (processor->depth == XML_MAX_DEPTH) {
+            HFLOG_ERROR("Too deep XML document.\n");
+            goto done;
+        }
+
+        /* the references are held by the tree */
+        processor->elems[processor->depth] = elem;
+        processor->children[processor->depth] = children;
+        processor->depth++;
+    }
+
+    success = true;
+
+done:
+    if (elem)
+        purc_variant_unref(elem);
+    if (children)
+        purc_variant_unref(children);
+    if (attr)
+        purc_variant_unref(attr);
+    if (tag)
+        purc_variant_unref(tag);
+    return success;
+}
+
+static bool end_element(xml_body_processor *processor)
+{
+    if (!read_name(processor, next_char(processor)) ||
+            skip_spaces(processor) != '>' || processor->depth == 0)
+        return false;
+
+    purc_variant_t elem = processor->elems[processor->depth - 1];
+    size_t len;
+    const char *tag = purc_variant_get_string_const_ex(
+            purc_variant_object_get_by_ckey(elem, "tag"), &len);
+    if (len != processor->tok.len ||
+            memcmp(tag, processor->tok.s, len) != 0) {
+        HFLOG_ERROR("Mismatched end tag of element %s\n", tag);
+        return false;
+    }
+
+    processor->depth--;
+    return true;
+}
+
+/* Parses the markup after `<`. */
+static bool parse_markup(xml_body_processor *processor)
+{
+    int c = next_char(processor);
+
+    switch (c) {
+    case '?':
+        /* the XML declaration or a processing instruction */
+        return skip_until(processor, "?>", NULL);
+
+    case '!':
+        c = next_char(processor);
+        if (c == '-') {
+            return next_char(processor) == '-' &&
+                skip_until(processor, "-->", NULL);
+        }
+        else if (c == '[') {
+            return expect(processor, "CDATA[") &&
+                skip_until(processor, "]]>", &processor->text);
+        }
+        else {
+            /* the document type declaration */
+            int brackets = 0;
+            while (c != EOF) {
+                if (c == '[')
+                    brackets++;
+                else if (c == ']')
+                    brackets--;
+                else if (c == '>' && brackets == 0)
+                    return true;
+                c = next_char(processor);
+            }
+            return false;
+        }
+
+    case '/':
+        return flush_text(processor) && end_element(processor);
+
+    default:
+        return flush_text(processor) && start_element(processor, c);
+    }
+}
+
+purc_variant_t
+purc_make_object_from_xml_stream(purc_rwstream_t stm)
+{
+    xml_body_processor *processor = calloc(1, sizeof(*processor));
+    if (processor == NULL) {
+        HFLOG_ERROR("Failed to allocate memory for XML processor.\n");
+        return PURC_VARIANT_INVALID;
+    }
+
+    processor->stm = stm;
+
+    int c;
+    while ((c = next_char(processor)) != EOF) {
+        bool success;
+        if (c == '<')
+            success = parse_markup(processor);
+        else if (c == '&')
+            success = read_entity(processor, &processor->text);
+        else
+            success = strbuf_putc(&processor->text, c);
+
+        if (!success)
+            goto failed;
+    }
+
+    if (!flush_text(processor) || processor->depth > 0 ||
+            processor->root == PURC_VARIANT_INVALID)
+        goto failed;
+
+    purc_variant_t root = processor->root;
+    free(processor->tok.s);
+    free(processor->text.s);
+    free(processor);
+    return root;
+
+failed:
+    HFLOG_ERROR("Not a well-formed XML document.\n");
+    if (processor->root)
+        purc_variant_unref(processor->root);
+    free(processor->tok.s);
+    free(processor->text.s);
+    free(processor);
+    return PURC_VARIANT_INVALID;
+}
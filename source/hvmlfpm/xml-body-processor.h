@@ -0,0 +1,31 @@
+#ifndef _xml_body_processor_h
+#define _xml_body_processor_h
+
+#include <purc/purc.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Parses the XML document read from stm, and makes a variant tree for it.
+ * Every element becomes an object like the following one:
+ *
+ *  {
+ *      "tag": "name",
+ *      "attr": { "attribute": "value", ... },
+ *      "children": [ child element object or text string, ... ]
+ *  }
+ *
+ * Texts having only white spaces are dropped; CDATA sections are texts.
+ * Returns the object of the root element, or PURC_VARIANT_INVALID if
+ * the document is not well-formed.
+ */
+purc_variant_t
+purc_make_object_from_xml_stream(purc_rwstream_t stm);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif